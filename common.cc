@@ -1,81 +1,1040 @@
-
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cmath>
 #include <common.h>
 #include <cstdio>
 #include <cstdlib>
+#include <climits>
 #include <cstring>
+#include <dirent.h>
 #include <faiss/Index.h>
+#include <faiss/index_io.h>
+#include <fcntl.h>
+#include <immintrin.h>
+#include <iostream>
 #include <memory>
+#include <numeric>
+#include <omp.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
-void ivecs_save(const char *fname, size_t d, size_t n, const faiss::idx_t *x) {
+#include <sys/uio.h>
+#include <unistd.h>
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static bool has_suffix(const char *fname, const char *suffix) {
+  size_t n = strlen(fname), m = strlen(suffix);
+  return n >= m && strcmp(fname + n - m, suffix) == 0;
+}
+
+static bool huge_pages_enabled = true;
+
+void set_huge_pages(bool enable) { huge_pages_enabled = enable; }
+
+// try reserved huge pages of 1 << shift bytes, nullptr if there are none
+static void *hugetlb_alloc(size_t bytes, int shift, size_t *mapped_bytes) {
+  size_t page = size_t(1) << shift;
+  size_t len = (bytes + page - 1) / page * page;
+  void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                     (shift << MAP_HUGE_SHIFT),
+                 -1, 0);
+  if (p == MAP_FAILED)
+    return nullptr;
+  *mapped_bytes = len;
+  return p;
+}
+
+void *huge_alloc(size_t bytes, size_t *mapped_bytes) {
+  if (bytes == 0)
+    bytes = 1;
+  if (huge_pages_enabled) {
+    // only use a huge page size when rounding up to whole pages wastes at
+    // most 1/8 of a page, a 1.01 GB matrix must not take 2 GB of the pool
+    auto fits = [bytes](int shift) {
+      size_t page = size_t(1) << shift;
+      return bytes >= page && (page - bytes % page) % page <= page / 8;
+    };
+    void *p = nullptr;
+    if (fits(30))
+      p = hugetlb_alloc(bytes, 30, mapped_bytes);
+    if (!p && fits(21))
+      p = hugetlb_alloc(bytes, 21, mapped_bytes);
+    if (p)
+      return p;
+  }
+  // regular pages, which the kernel can still back with transparent huge
+  // pages when the mapping is 2 MB aligned
+  size_t page = size_t(1) << 21;
+  size_t len = (bytes + 4095) / 4096 * 4096;
+  size_t over = bytes >= page ? page : 0;
+  char *p = (char *)mmap(nullptr, len + over, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "could not allocate %zu bytes\n", bytes);
+    perror("");
+    abort();
+  }
+  if (over) {
+    // trim the mapping to a 2 MB aligned start
+    size_t head = (page - (uintptr_t)p % page) % page;
+    if (head)
+      munmap(p, head);
+    if (over - head)
+      munmap(p + head + len, over - head);
+    p += head;
+  }
+  madvise(p, len, huge_pages_enabled ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+  *mapped_bytes = len;
+  return p;
+}
+
+void HugeFree::operator()(void *p) const {
+  if (p)
+    munmap(p, bytes);
+}
+
+TlbMissCounter::~TlbMissCounter() {
+  for (int fd : fds)
+    close(fd);
+}
+
+void TlbMissCounter::start() {
+  for (int fd : fds)
+    close(fd);
+  fds.clear();
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // inherit does not reach threads that already exist (the OpenMP pool), so
+  // open one counter per thread of the process
+  attr.inherit = 1;
+  DIR *dir = opendir("/proc/self/task");
+  if (!dir)
+    return;
+  while (struct dirent *e = readdir(dir)) {
+    if (e->d_name[0] == '.')
+      continue;
+    pid_t tid = atoi(e->d_name);
+    int fd = syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+    if (fd < 0)
+      continue;
+    fds.push_back(fd);
+  }
+  closedir(dir);
+  for (int fd : fds) {
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+long long TlbMissCounter::stop() {
+  if (fds.empty())
+    return -1;
+  long long total = 0;
+  for (int fd : fds) {
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long count;
+    if (read(fd, &count, sizeof(count)) == sizeof(count))
+      total += count;
+  }
+  return total;
+}
+
+// parse a sysfs cpu or node list such as "0-15,32-47"
+static std::vector<int> read_list(const char *fname) {
+  std::vector<int> list;
+  FILE *f = fopen(fname, "r");
+  if (!f)
+    return list;
+  int a, b;
+  while (fscanf(f, "%d", &a) == 1) {
+    b = a;
+    if (fscanf(f, "-%d", &b) < 0)
+      b = a;
+    for (int i = a; i <= b; i++)
+      list.push_back(i);
+    if (fgetc(f) != ',')
+      break;
+  }
+  fclose(f);
+  return list;
+}
+
+static std::vector<int> numa_nodes() {
+  auto nodes = read_list("/sys/devices/system/node/online");
+  if (nodes.empty())
+    nodes.push_back(0);
+  return nodes;
+}
+
+int numa_node_count() { return numa_nodes().size(); }
+
+bool numa_interleave() {
+  auto nodes = numa_nodes();
+  if (nodes.size() < 2)
+    return false;
+  int max_node = nodes.back();
+  std::vector<unsigned long> mask(max_node / 64 + 1);
+  for (int node : nodes)
+    mask[node / 64] |= 1ul << (node % 64);
+  // no libnuma dependency, MPOL_INTERLEAVE = 3
+  if (syscall(SYS_set_mempolicy, 3, mask.data(), max_node + 2) != 0) {
+    perror("set_mempolicy");
+    return false;
+  }
+  return true;
+}
+
+void numa_pin_threads() {
+  auto nodes = numa_nodes();
+  std::vector<std::vector<int>> cpus;
+  for (int node : nodes) {
+    char fname[100];
+    snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/cpulist",
+             node);
+    cpus.push_back(read_list(fname));
+  }
+#pragma omp parallel
+  {
+    int rank = omp_get_thread_num(), nt = omp_get_num_threads();
+    const auto &list = cpus[size_t(rank) * cpus.size() / nt];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : list)
+      CPU_SET(cpu, &set);
+    if (!list.empty() && sched_setaffinity(0, sizeof(set), &set) != 0)
+      perror("sched_setaffinity");
+  }
+}
+
+NumaStat NumaStat::read() {
+  NumaStat st;
+  for (int node : numa_nodes()) {
+    char fname[100];
+    snprintf(fname, sizeof(fname), "/sys/devices/system/node/node%d/numastat",
+             node);
+    Node n;
+    if (FILE *f = fopen(fname, "r")) {
+      char key[64];
+      long long value;
+      while (fscanf(f, "%63s %lld", key, &value) == 2) {
+        if (!strcmp(key, "local_node"))
+          n.local_node = value;
+        else if (!strcmp(key, "other_node"))
+          n.other_node = value;
+        else if (!strcmp(key, "numa_miss"))
+          n.numa_miss = value;
+      }
+      fclose(f);
+    }
+    st.nodes.push_back(n);
+  }
+  return st;
+}
+
+void NumaStat::print_since(const NumaStat &before, const char *what) const {
+  double mb = sysconf(_SC_PAGESIZE) / double(1 << 20);
+  for (size_t i = 0; i < nodes.size() && i < before.nodes.size(); i++) {
+    const Node &a = before.nodes[i], &b = nodes[i];
+    printf("%s node %zu: local %.1f MB, remote %.1f MB, miss %.1f MB\n", what,
+           i, (b.local_node - a.local_node) * mb,
+           (b.other_node - a.other_node) * mb,
+           (b.numa_miss - a.numa_miss) * mb);
+  }
+}
+
+VecsLayout::VecsLayout(const char *fname, int fd) {
+  bin = true;
+  if (has_suffix(fname, ".fbin")) {
+    type = F32;
+  } else if (has_suffix(fname, ".ibin")) {
+    type = I32;
+  } else if (has_suffix(fname, ".u8bin")) {
+    type = U8;
+  } else if (has_suffix(fname, ".i8bin")) {
+    type = I8;
+  } else if (has_suffix(fname, ".f16bin")) {
+    type = F16;
+  } else if (has_suffix(fname, ".bf16bin")) {
+    type = BF16;
+  } else {
+    bin = false;
+    type = has_suffix(fname, ".bvecs")   ? U8
+           : has_suffix(fname, ".ivecs") ? I32
+                                         : F32;
+  }
+  elem_size = type == U8 || type == I8      ? 1
+              : type == F16 || type == BF16 ? 2
+                                            : 4;
+
+  struct stat st;
+  fstat(fd, &st);
+  size_t sz = st.st_size;
+  if (bin) {
+    uint32_t header[2];
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+      fprintf(stderr, "could not read header of %s\n", fname);
+      perror("");
+      abort();
+    }
+    n = header[0];
+    d = header[1];
+    assert((d > 0 && d < 1000000) || !"unreasonable dimension");
+    assert(sz == file_header() + n * row_bytes() || !"weird file size");
+  } else {
+    int dim;
+    if (pread(fd, &dim, sizeof(int), 0) != sizeof(int)) {
+      fprintf(stderr, "could not read vector dimension in %s\n", fname);
+      perror("");
+      abort();
+    }
+    assert((dim > 0 && dim < 1000000) || !"unreasonable dimension");
+    d = dim;
+    assert(sz % row_bytes() == 0 || !"weird file size");
+    n = sz / row_bytes();
+  }
+}
+
+static void read_all(int fd, char *p, size_t len, off_t off) {
+  for (size_t got = 0; got < len;) {
+    ssize_t r = pread(fd, p + got, len - got, off + got);
+    if (r <= 0) {
+      fprintf(stderr, "could not read whole file\n");
+      perror("");
+      abort();
+    }
+    got += r;
+  }
+}
+
+// read rows [i0, i0 + ni) into dst without their headers. headerless (bin)
+// rows are read in place, the others go through a staging buffer of
+// stage_rows rows
+static void pread_rows(int fd, const VecsLayout &layout, size_t i0, size_t ni,
+                       char *dst, char *stage, size_t stage_rows) {
+  size_t vec_bytes = layout.d * layout.elem_size;
+  size_t row_bytes = layout.row_bytes();
+  if (layout.bin) {
+    read_all(fd, dst, ni * vec_bytes, layout.row_offset(i0));
+    return;
+  }
+  for (size_t done = 0; done < ni;) {
+    size_t nr = std::min(stage_rows, ni - done);
+    read_all(fd, stage, nr * row_bytes,
+             layout.row_offset(i0 + done) - layout.row_header());
+    for (size_t i = 0; i < nr; i++)
+      memcpy(dst + (done + i) * vec_bytes,
+             stage + i * row_bytes + layout.row_header(), vec_bytes);
+    done += nr;
+  }
+}
+
+// load a whole vector file with elements of type T, see fvecs_read
+template <class T>
+static HugeArray<T> vecs_read(const char *fname, size_t *d_out,
+                              size_t *n_out, int nthreads) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s\n", fname);
+    perror("");
+    abort();
+  }
+  VecsLayout layout(fname, fd);
+  if (layout.elem_size != sizeof(T)) {
+    fprintf(stderr, "%s has %zu byte components, expected %zu\n", fname,
+            layout.elem_size, sizeof(T));
+    abort();
+  }
+  size_t d = layout.d, n = layout.n;
+  size_t row_bytes = layout.row_bytes();
+  size_t sz = n * row_bytes;
+
+  *d_out = d;
+  *n_out = n;
+  auto x = huge_array<T>(n * d);
+  if (nthreads <= 0)
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  // small files are not worth the thread startup
+  size_t min_rows_per_thread = std::max<size_t>(1, (4 << 20) / row_bytes);
+  nthreads = std::min<size_t>(nthreads, n / min_rows_per_thread + 1);
+
+  double t = now();
+  // each thread reads a contiguous row range straight into its final place
+  auto read_range = [&](int rank) {
+    size_t i0 = n * rank / nthreads;
+    size_t i1 = n * (rank + 1) / nthreads;
+    size_t stage_rows = std::max<size_t>(1, (4 << 20) / row_bytes);
+    std::unique_ptr<char[]> stage;
+    if (!layout.bin)
+      stage.reset(new char[stage_rows * row_bytes]);
+    pread_rows(fd, layout, i0, i1 - i0,
+               reinterpret_cast<char *>(x.get() + i0 * d), stage.get(),
+               stage_rows);
+  };
+  std::vector<std::thread> threads;
+  for (int rank = 1; rank < nthreads; rank++)
+    threads.emplace_back(read_range, rank);
+  read_range(0);
+  for (auto &th : threads)
+    th.join();
+  t = now() - t;
+
+  printf("read %s: %.2f GB in %.3f s, %.2f GB/s with %d threads\n", fname,
+         sz / 1e9, t, sz / 1e9 / std::max(t, 1e-9), nthreads);
+
+  close(fd);
+  return x;
+}
+
+HugeArray<float> fvecs_read(const char *fname, size_t *d_out,
+                            size_t *n_out, int nthreads) {
+  return vecs_read<float>(fname, d_out, n_out, nthreads);
+}
+
+HugeArray<int> ivecs_read(const char *fname, size_t *d_out,
+                          size_t *n_out, int nthreads) {
+  return vecs_read<int>(fname, d_out, n_out, nthreads);
+}
+
+HugeArray<uint8_t> bvecs_read(const char *fname, size_t *d_out,
+                              size_t *n_out, int nthreads) {
+  return vecs_read<uint8_t>(fname, d_out, n_out, nthreads);
+}
+
+/*****************************************************
+ * fp16 / bf16 widening
+ *****************************************************/
+
+static float half_to_float(uint16_t h) {
+  uint32_t sign = uint32_t(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else if (exp != 0) {
+    bits = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  } else if (mant == 0) {
+    bits = sign;
+  } else {
+    // subnormal, renormalize the mantissa
+    exp = 127 - 15 + 1;
+    while (!(mant & 0x400)) {
+      mant <<= 1;
+      exp--;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static void widen_f16_scalar(const uint16_t *src, size_t nd, float *dst) {
+  for (size_t i = 0; i < nd; i++)
+    dst[i] = half_to_float(src[i]);
+}
+
+static void widen_bf16_scalar(const uint16_t *src, size_t nd, float *dst) {
+  for (size_t i = 0; i < nd; i++) {
+    uint32_t bits = uint32_t(src[i]) << 16;
+    memcpy(dst + i, &bits, sizeof(float));
+  }
+}
+
+#if defined(__x86_64__)
+// the zero-masked forms of the conversions: GCC 12 warns that the
+// undefined register behind the unmasked ones may be used uninitialized
+__attribute__((target("avx512f"))) static void
+widen_f16_avx512(const uint16_t *src, size_t nd, float *dst) {
+  size_t i = 0;
+  for (; i + 16 <= nd; i += 16) {
+    __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    _mm512_storeu_ps(dst + i, _mm512_maskz_cvtph_ps(0xffff, h));
+  }
+  widen_f16_scalar(src + i, nd - i, dst + i);
+}
+
+__attribute__((target("avx512f"))) static void
+widen_bf16_avx512(const uint16_t *src, size_t nd, float *dst) {
+  size_t i = 0;
+  for (; i + 16 <= nd; i += 16) {
+    __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    __m512i w = _mm512_maskz_slli_epi32(
+        0xffff, _mm512_maskz_cvtepu16_epi32(0xffff, h), 16);
+    _mm512_storeu_si512(dst + i, w);
+  }
+  widen_bf16_scalar(src + i, nd - i, dst + i);
+}
+
+__attribute__((target("avx,f16c"))) static void
+widen_f16_f16c(const uint16_t *src, size_t nd, float *dst) {
+  size_t i = 0;
+  for (; i + 8 <= nd; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+  }
+  widen_f16_scalar(src + i, nd - i, dst + i);
+}
+
+__attribute__((target("avx2"))) static void
+widen_bf16_avx2(const uint16_t *src, size_t nd, float *dst) {
+  size_t i = 0;
+  for (; i + 8 <= nd; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m256i w = _mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), w);
+  }
+  widen_bf16_scalar(src + i, nd - i, dst + i);
+}
+#endif
+
+typedef void (*widen_fn)(const uint16_t *, size_t, float *);
+
+// pick the widest conversion the cpu supports, once
+static widen_fn pick_widen(bool bf16) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return bf16 ? widen_bf16_avx512 : widen_f16_avx512;
+  if (bf16 && __builtin_cpu_supports("avx2"))
+    return widen_bf16_avx2;
+  if (!bf16 && __builtin_cpu_supports("f16c"))
+    return widen_f16_f16c;
+#endif
+  return bf16 ? widen_bf16_scalar : widen_f16_scalar;
+}
+
+// convert nd components of the given type to float
+static void widen(VecsLayout::Type type, const char *src, size_t nd,
+                  float *dst) {
+  static const widen_fn widen_f16 = pick_widen(false);
+  static const widen_fn widen_bf16 = pick_widen(true);
+  switch (type) {
+  case VecsLayout::F32:
+    memcpy(dst, src, nd * sizeof(float));
+    break;
+  case VecsLayout::F16:
+    widen_f16(reinterpret_cast<const uint16_t *>(src), nd, dst);
+    break;
+  case VecsLayout::BF16:
+    widen_bf16(reinterpret_cast<const uint16_t *>(src), nd, dst);
+    break;
+  case VecsLayout::U8:
+    for (size_t i = 0; i < nd; i++)
+      dst[i] = reinterpret_cast<const uint8_t *>(src)[i];
+    break;
+  case VecsLayout::I8:
+    for (size_t i = 0; i < nd; i++)
+      dst[i] = reinterpret_cast<const int8_t *>(src)[i];
+    break;
+  case VecsLayout::I32:
+    fprintf(stderr, "integer id files cannot be used as vectors\n");
+    abort();
+  }
+}
+
+HugeArray<float> vecs_read_as_float(const char *fname, size_t *d_out,
+                                    size_t *n_out, int nthreads) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s\n", fname);
+    perror("");
+    abort();
+  }
+  VecsLayout layout(fname, fd);
+  close(fd);
+  // rejected before anything is read into a buffer of the wrong size
+  if (layout.type == VecsLayout::I32) {
+    fprintf(stderr, "%s holds integer ids, not vectors\n", fname);
+    abort();
+  }
+  if (layout.type == VecsLayout::F32)
+    return fvecs_read(fname, d_out, n_out, nthreads);
+  size_t nd = layout.d * layout.n;
+  auto x = huge_array<float>(nd);
+  if (layout.elem_size == 1) {
+    auto xb = bvecs_read(fname, d_out, n_out, nthreads);
+    widen(layout.type, reinterpret_cast<const char *>(xb.get()), nd, x.get());
+  } else {
+    auto xh = vecs_read<uint16_t>(fname, d_out, n_out, nthreads);
+    widen(layout.type, reinterpret_cast<const char *>(xh.get()), nd, x.get());
+  }
+  return x;
+}
+
+template <class T>
+static void bin_save(const char *fname, size_t d, size_t n, const T *x) {
   FILE *f = fopen(fname, "w");
   if (!f) {
     fprintf(stderr, "could not open %s for writing\n", fname);
     perror("");
     abort();
   }
-  auto temp_int = std::unique_ptr<int[]>(new int[d]);
-  for (size_t i = 0; i < n; i++) {
-    fwrite(&d, 1, sizeof(int), f);
-    const faiss::idx_t *xi = x + i * d;
-    for (size_t j = 0; j < d; j++) {
-      temp_int[j] = xi[j];
-    }
-    fwrite(temp_int.get(), d, sizeof(int), f);
+  uint32_t header[2] = {uint32_t(n), uint32_t(d)};
+  if (fwrite(header, sizeof(header), 1, f) != 1 ||
+      fwrite(x, sizeof(T), n * d, f) != n * d) {
+    fprintf(stderr, "could not write %s\n", fname);
+    perror("");
+    abort();
   }
-  fflush(f);
   fclose(f);
 }
 
-std::unique_ptr<float[]> fvecs_read(const char *fname, size_t *d_out,
-                                    size_t *n_out) {
-  FILE *f = fopen(fname, "r");
-  if (!f) {
+void fbin_save(const char *fname, size_t d, size_t n, const float *x) {
+  bin_save(fname, d, n, x);
+}
+
+void u8bin_save(const char *fname, size_t d, size_t n, const uint8_t *x) {
+  bin_save(fname, d, n, x);
+}
+
+VecsMmap::VecsMmap(const char *fname, size_t start, size_t end, int advice) {
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {
     fprintf(stderr, "could not open %s\n", fname);
     perror("");
     abort();
   }
-  int d;
-  auto r = fread(&d, 1, sizeof(int), f);
-  if (r == 0) {
-    fprintf(stderr, "could not read vector dimension in %s\n", fname);
+  layout = VecsLayout(fname, fd);
+  end = std::min(end, layout.n);
+  if (start > end) {
+    fprintf(stderr, "row range %ld:%ld is outside of %s (%ld rows)\n", start,
+            end, fname, layout.n);
+    abort();
+  }
+  d = layout.d;
+  n = end - start;
+  first = start;
+  // map only the pages holding the rows, from a page aligned offset
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t begin = layout.row_offset(start) - layout.row_header();
+  map_off = begin - begin % page;
+  size = layout.row_offset(end) - layout.row_header() - map_off;
+  if (n == 0) {
+    close(fd);
+    return;
+  }
+
+  void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, map_off);
+  if (p == MAP_FAILED) {
+    fprintf(stderr, "could not mmap %s\n", fname);
     perror("");
     abort();
   }
-  assert((d > 0 && d < 1000000) || !"unreasonable dimension");
-  fseek(f, 0, SEEK_SET);
+  // the mapping keeps its own reference to the file
+  close(fd);
+  data = static_cast<const char *>(p);
+  madvise(p, size, advice);
+}
+
+VecsMmap::~VecsMmap() {
+  if (data)
+    munmap(const_cast<char *>(data), size);
+}
+
+void VecsMmap::copy_rows(size_t i0, size_t ni, float *dst) const {
+  assert(i0 + ni <= n);
+  if (layout.bin) {
+    widen(layout.type, at(i0), ni * d, dst);
+    return;
+  }
+  // integer components are widened only here, one block at a time
+  for (size_t i = 0; i < ni; i++)
+    widen(layout.type, at(i0 + i), d, dst + i * d);
+}
+
+void VecsMmap::advise(size_t i0, size_t ni, int advice) const {
+  if (i0 >= n)
+    return;
+  ni = std::min(ni, n - i0);
+  // madvise wants a page aligned start address
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t begin = at(i0) - layout.row_header() - data;
+  size_t end = at(i0 + ni) - layout.row_header() - data;
+  begin -= begin % page;
+  madvise(const_cast<char *>(data) + begin, end - begin, advice);
+}
+
+VecsBlockReader::VecsBlockReader(const VecsMmap &file, size_t bs, bool async,
+                                 size_t start)
+    : file(file), bs(bs), async(async && !file.contiguous()), cur(start),
+      pos(start) {
+  assert(bs > 0);
+  if (file.contiguous())
+    return;
+  buf[0] = huge_array<float>(bs * file.d);
+  if (this->async)
+    buf[1] = huge_array<float>(bs * file.d);
+}
+
+VecsBlockReader::~VecsBlockReader() {
+  // the background copy writes into buf, let it finish before they go away
+  if (pending.valid())
+    pending.wait();
+}
+
+void VecsBlockReader::fetch(int slot) {
+  size_t i0 = pos;
+  size_t ni = std::min(bs, file.n - i0);
+  pos = i0 + ni;
+  pending_i0 = i0;
+  float *dst = buf[slot].get();
+  pending = std::async(std::launch::async, [this, i0, ni, dst]() {
+    file.copy_rows(i0, ni, dst);
+    return ni;
+  });
+}
+
+size_t VecsBlockReader::next() {
+  if (!async) {
+    if (pos >= file.n)
+      return 0;
+    cur = pos;
+    size_t ni = std::min(bs, file.n - cur);
+    // start paging in the following block while this one is used
+    file.advise(cur + ni, bs, MADV_WILLNEED);
+    if (const float *x = file.contiguous()) {
+      block = x + cur * file.d;
+    } else {
+      double t = now();
+      file.copy_rows(cur, ni, buf[0].get());
+      io_wait += now() - t;
+      block = buf[0].get();
+    }
+    pos = cur + ni;
+    return ni;
+  }
+  if (!pending.valid()) {
+    // first call, nothing was prefetched yet
+    if (pos >= file.n)
+      return 0;
+    fetch(1 - front);
+  }
+  double t = now();
+  size_t ni = pending.get();
+  io_wait += now() - t;
+  cur = pending_i0;
+  front = 1 - front;
+  block = buf[front].get();
+  // the caller is done with the old front buffer, refill it in the background
+  if (pos < file.n)
+    fetch(1 - front);
+  return ni;
+}
+
+// duplicate of the original stdout once reserve_stdout_for_output() ran
+static int reserved_stdout = -1;
+
+void reserve_stdout_for_output() {
+  if (reserved_stdout >= 0)
+    return;
+  fflush(stdout);
+  std::cout.flush();
+  reserved_stdout = dup(STDOUT_FILENO);
+  dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+IvecsWriter::IvecsWriter(const char *fname, size_t d, size_t n, bool resume)
+    : d(d), n(n), fname(fname), bin(has_suffix(fname, ".ibin")) {
+  if (this->fname == "-") {
+    fd = reserved_stdout >= 0 ? reserved_stdout : STDOUT_FILENO;
+  } else {
+    fd = open(fname, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+      fprintf(stderr, "could not open %s for writing\n", fname);
+      perror("");
+      abort();
+    }
+  }
   struct stat st;
-  fstat(fileno(f), &st);
-  size_t sz = st.st_size;
-  assert(sz % ((d + 1) * 4) == 0 || !"weird file size");
-  size_t n = sz / ((d + 1) * 4);
+  fstat(fd, &st);
+  seekable = S_ISREG(st.st_mode);
+  if (bin) {
+    uint32_t header[2] = {uint32_t(n), uint32_t(d)};
+    write_all(reinterpret_cast<const char *>(header), sizeof(header), 0);
+  }
+}
 
-  *d_out = d;
-  *n_out = n;
-  auto x = std::unique_ptr<float[]>(new float[n * (d + 1)]);
-  size_t nr = fread(x.get(), sizeof(float), n * (d + 1), f);
-  if (nr != n * (d + 1)) {
-    fprintf(stderr, "could not read whole file\n");
+IvecsWriter::~IvecsWriter() {
+  if (!held.empty())
+    fprintf(stderr, "%s: %ld blocks after row %ld were never written\n",
+            fname.c_str(), held.size(), next_row);
+  if (fd != STDOUT_FILENO && fd != reserved_stdout)
+    close(fd);
+}
+
+void IvecsWriter::write_all(const char *p, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t r = seekable ? pwrite(fd, p, len, off) : write(fd, p, len);
+    if (r < 0) {
+      fprintf(stderr, "could not write to %s\n", fname.c_str());
+      perror("");
+      abort();
+    }
+    p += r;
+    off += r;
+    len -= r;
+  }
+}
+
+void IvecsWriter::writev_all(std::vector<struct iovec> &iov, off_t off) {
+  struct iovec *v = iov.data();
+  int nv = iov.size();
+  while (nv > 0) {
+    ssize_t r = pwritev(fd, v, nv, off);
+    if (r < 0) {
+      fprintf(stderr, "could not write to %s\n", fname.c_str());
+      perror("");
+      abort();
+    }
+    off += r;
+    // skip what was written, a short write can end inside a row
+    for (; nv > 0 && size_t(r) >= v->iov_len; v++, nv--)
+      r -= v->iov_len;
+    if (nv > 0) {
+      v->iov_base = (char *)v->iov_base + r;
+      v->iov_len -= r;
+    }
+  }
+}
+
+std::vector<int> IvecsWriter::convert(size_t ni, const faiss::idx_t *x) const {
+  // narrow to the on-disk layout: an int header (not for ibin) then d ints
+  size_t header = bin ? 0 : 1;
+  size_t row_ints = header + d;
+  std::vector<int> rows(ni * row_ints);
+  for (size_t i = 0; i < ni; i++) {
+    int *ri = rows.data() + i * row_ints;
+    if (!bin)
+      ri[0] = d;
+    for (size_t j = 0; j < d; j++)
+      ri[header + j] = x[i * d + j];
+  }
+  return rows;
+}
+
+void IvecsWriter::write_block(size_t i0, size_t ni, const faiss::idx_t *x) {
+  assert(i0 + ni <= n);
+  std::vector<int> rows = convert(ni, x);
+  size_t row_ints = (bin ? 0 : 1) + d;
+  if (seekable) {
+    write_all(reinterpret_cast<const char *>(rows.data()),
+              rows.size() * sizeof(int), row_offset(i0));
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  held.emplace(i0, std::move(rows));
+  while (!held.empty() && held.begin()->first == next_row) {
+    auto &block = held.begin()->second;
+    write_all(reinterpret_cast<const char *>(block.data()),
+              block.size() * sizeof(int), 0);
+    next_row += block.size() / row_ints;
+    held.erase(held.begin());
+  }
+}
+
+void IvecsWriter::write_rows(size_t ni, const faiss::idx_t *ids,
+                             const faiss::idx_t *x) {
+  if (!seekable) {
+    fprintf(stderr, "%s: rows out of order need a regular file\n",
+            fname.c_str());
+    abort();
+  }
+  std::vector<int> rows = convert(ni, x);
+  size_t row_bytes = (bin ? 0 : sizeof(int)) + d * sizeof(int);
+  std::vector<size_t> order(ni);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return ids[a] < ids[b]; });
+  std::vector<struct iovec> iov;
+  for (size_t i = 0; i < ni;) {
+    // the run of consecutive ids from ids[order[i]] on, in place in rows
+    size_t first = ids[order[i]];
+    assert(first < n);
+    iov.clear();
+    for (; i < ni && iov.size() < IOV_MAX &&
+           size_t(ids[order[i]]) == first + iov.size();
+         i++)
+      iov.push_back({(char *)rows.data() + order[i] * row_bytes, row_bytes});
+    assert(first + iov.size() <= n);
+    writev_all(iov, row_offset(first));
+  }
+}
+
+void IvecsWriter::sync() {
+  if (seekable && fdatasync(fd) != 0) {
+    fprintf(stderr, "could not sync %s\n", fname.c_str());
     perror("");
     abort();
   }
+}
 
-  assert(nr == n * (d + 1) || !"could not read whole file");
+void ivecs_save(const char *fname, size_t d, size_t n, const faiss::idx_t *x) {
+  IvecsWriter writer(fname, d, n);
+  int nthreads = writer.seekable ? std::thread::hardware_concurrency() : 1;
+  nthreads = std::max<size_t>(1, std::min<size_t>(nthreads, n / 65536 + 1));
+  // blocks of 64k rows keep the conversion buffers small
+  auto write_range = [&](int rank) {
+    size_t i0 = n * rank / nthreads;
+    size_t i1 = n * (rank + 1) / nthreads;
+    for (size_t i = i0; i < i1; i += 65536) {
+      size_t ni = std::min<size_t>(65536, i1 - i);
+      writer.write_block(i, ni, x + i * d);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int rank = 1; rank < nthreads; rank++)
+    threads.emplace_back(write_range, rank);
+  write_range(0);
+  for (auto &th : threads)
+    th.join();
+}
 
-  // shift array to remove row headers
-  for (size_t i = 0; i < n; i++)
-    memmove(x.get() + i * d, x.get() + 1 + i * (d + 1), d * sizeof(*x.get()));
+std::string file_fingerprint(const char *fname) {
+  struct stat st;
+  if (stat(fname, &st) != 0) {
+    fprintf(stderr, "could not stat %s\n", fname);
+    perror("");
+    abort();
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), " %lld %lld.%09ld", (long long)st.st_size,
+           (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+  return fname + std::string(buf);
+}
 
-  fclose(f);
-  return x;
+KnnCheckpoint::KnnCheckpoint(const std::string &output,
+                             const std::string &fingerprint)
+    : fname(output + ".ckpt") {
+  // a manifest only makes sense for an output that can be written in place
+  struct stat st;
+  bool exists = stat(output.c_str(), &st) == 0;
+  if (output == "-" || (exists && !S_ISREG(st.st_mode)))
+    return;
+  FILE *f = exists ? fopen(fname.c_str(), "r") : nullptr;
+  if (f) {
+    char *line = nullptr;
+    size_t cap = 0;
+    ssize_t len = getline(&line, &cap, f);
+    bool same = len > 0 && std::string(line, len - 1) == fingerprint;
+    // a line without its newline is a torn append from a crash, drop it
+    while (same && (len = getline(&line, &cap, f)) > 0 &&
+           line[len - 1] == '\n') {
+      size_t i0, ni;
+      if (sscanf(line, "%zu %zu", &i0, &ni) == 2)
+        done[i0] = i0 + ni;
+    }
+    free(line);
+    fclose(f);
+    if (!same)
+      fprintf(stderr, "%s is from another build, starting over\n",
+              fname.c_str());
+  }
+  // rewrite the manifest with what is kept, so that torn lines go away
+  fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "could not open %s for writing\n", fname.c_str());
+    perror("");
+    abort();
+  }
+  std::string text = fingerprint + "\n";
+  for (auto &r : done)
+    text += std::to_string(r.first) + " " +
+            std::to_string(r.second - r.first) + "\n";
+  if (write(fd, text.data(), text.size()) != ssize_t(text.size()) ||
+      fdatasync(fd) != 0) {
+    fprintf(stderr, "could not write %s\n", fname.c_str());
+    perror("");
+    abort();
+  }
+  if (start() > 0)
+    printf("%s: resuming at row %zu\n", fname.c_str(), start());
 }
 
-// not very clean, but works as long as sizeof(int) == sizeof(float)
-std::unique_ptr<int[]> ivecs_read(const char *fname, size_t *d_out,
-                                  size_t *n_out) {
-  return std::unique_ptr<int[]>(
-      reinterpret_cast<int *>(fvecs_read(fname, d_out, n_out).release()));
+KnnCheckpoint::~KnnCheckpoint() {
+  if (fd >= 0)
+    close(fd);
+}
+
+size_t KnnCheckpoint::start() const {
+  size_t row = 0;
+  for (auto it = done.begin(); it != done.end() && it->first <= row; ++it)
+    row = std::max(row, it->second);
+  return row;
+}
+
+void KnnCheckpoint::add(size_t i0, size_t ni) {
+  if (fd < 0)
+    return;
+  done[i0] = i0 + ni;
+  char line[64];
+  int len = snprintf(line, sizeof(line), "%zu %zu\n", i0, ni);
+  if (write(fd, line, len) != len || fdatasync(fd) != 0) {
+    fprintf(stderr, "could not write %s\n", fname.c_str());
+    perror("");
+    abort();
+  }
+}
+
+void KnnCheckpoint::finish() {
+  if (fd < 0)
+    return;
+  close(fd);
+  fd = -1;
+  unlink(fname.c_str());
+}
+
+std::string index_cache_file(const std::string &dir, const std::string &key,
+                             const char *ext) {
+  if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+    fprintf(stderr, "could not create %s\n", dir.c_str());
+    perror("");
+    abort();
+  }
+  // FNV-1a, stable across builds unlike std::hash
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : key) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx", (unsigned long long)h);
+  std::string base = dir + name;
+  if (FILE *f = fopen((base + ".key").c_str(), "w")) {
+    fprintf(f, "%s\n", key.c_str());
+    fclose(f);
+  }
+  return base + ext;
+}
+
+void write_index_atomic(const faiss::Index *index, const std::string &fname) {
+  std::string tmp = fname + ".tmp." + std::to_string(getpid());
+  faiss::write_index(index, tmp.c_str());
+  if (rename(tmp.c_str(), fname.c_str()) != 0) {
+    fprintf(stderr, "could not rename %s to %s\n", tmp.c_str(), fname.c_str());
+    perror("");
+    abort();
+  }
 }
@@ -1,8 +1,346 @@
+#pragma once
+#include <cassert>
+#include <cstdint>
 #include <faiss/Index.h>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
+/// frees memory from huge_alloc
+struct HugeFree {
+  size_t bytes = 0;
+  void operator()(void *p) const;
+};
+
+/// array backed by huge pages, see huge_array
+template <class T> using HugeArray = std::unique_ptr<T[], HugeFree>;
+
+/// allow or forbid huge pages for later huge_alloc calls (allowed by default),
+/// so runs with and without them can be compared
+void set_huge_pages(bool enable);
+
+/// page aligned anonymous memory for large matrices. it comes from reserved
+/// 1 GB or 2 MB huge pages (MAP_HUGETLB) when the system has some and the
+/// request is at least one page and wastes at most 1/8 of a page to rounding
+/// up, and otherwise from regular pages that are madvised for transparent
+/// huge pages. mapped_bytes receives the size to pass to HugeFree.
+void *huge_alloc(size_t bytes, size_t *mapped_bytes);
+
+/// uninitialized n element array from huge_alloc
+template <class T> HugeArray<T> huge_array(size_t n) {
+  size_t mapped;
+  T *p = static_cast<T *>(huge_alloc(n * sizeof(T), &mapped));
+  return HugeArray<T>(p, HugeFree{mapped});
+}
+
+/// counts the dTLB load misses of all threads of the process between start()
+/// and stop() with perf_event_open. stop() returns -1 when the counters are
+/// not available (no permission, no pmu).
+class TlbMissCounter {
+public:
+  ~TlbMissCounter();
+  void start();
+  long long stop();
+
+private:
+  std::vector<int> fds;
+};
+
+/// number of NUMA nodes, 1 on machines without NUMA
+int numa_node_count();
+/// interleave the pages of every later allocation of the calling thread and
+/// of the threads it starts afterwards (faiss' OpenMP pool) over all nodes.
+/// this covers the inverted lists built by add, the result buffers and the
+/// page cache pages of mapped files that are faulted in afterwards. pages of
+/// a file that is already in the page cache (a base read by an earlier run)
+/// stay on the node they were first read on; drop them first (vmtouch -e,
+/// or echo 1 > /proc/sys/vm/drop_caches) to interleave them too. call it
+/// before the first OpenMP region. returns false when the kernel refuses
+/// (no NUMA support)
+bool numa_interleave();
+/// pin the OpenMP threads to the cpus of the nodes, the threads split evenly
+/// over the nodes in thread number order
+void numa_pin_threads();
+
+/// per node page allocation counters of /sys/devices/system/node/*/numastat,
+/// to check how much of the memory a stage touched came from a remote node
+struct NumaStat {
+  struct Node {
+    long long local_node = 0; // allocated on this node by a local thread
+    long long other_node = 0; // allocated on this node by a remote thread
+    long long numa_miss = 0;  // allocated here while meant for another node
+  };
+  static NumaStat read();
+  /// print the counters accumulated since before, in MB per node
+  void print_since(const NumaStat &before, const char *what) const;
+
+  std::vector<Node> nodes;
+};
+
+/// on-disk layout of a vector file, picked from its extension.
+///
+/// .fvecs/.ivecs/.bvecs rows each start with an int dimension header. the
+/// big-ann-benchmarks .fbin/.ibin/.u8bin/.i8bin files have a single
+/// (uint32 n, uint32 d) header followed by the contiguous n * d matrix.
+/// .f16bin/.bf16bin use the same layout with half precision floats (written
+/// by the to_half tool) and are widened to float when read.
+struct VecsLayout {
+  enum Type { F32, I32, U8, I8, F16, BF16 };
+
+  VecsLayout() = default;
+  /// parse the header of an open file and check its size
+  VecsLayout(const char *fname, int fd);
+
+  size_t file_header() const { return bin ? 2 * sizeof(uint32_t) : 0; }
+  size_t row_header() const { return bin ? 0 : sizeof(int); }
+  size_t row_bytes() const { return row_header() + d * elem_size; }
+  /// byte offset of the first component of row i
+  size_t row_offset(size_t i) const {
+    return file_header() + i * row_bytes() + row_header();
+  }
+
+  Type type = F32;
+  size_t elem_size = 4;
+  bool bin = false;
+  size_t d = 0;
+  size_t n = 0;
+};
+
+/// write a n * d matrix of ids as ivecs (or ibin for .ibin), converting and
+/// writing row ranges from several threads
 void ivecs_save(const char *fname, size_t d, size_t n, const faiss::idx_t *x);
-std::unique_ptr<float[]> fvecs_read(const char *fname, size_t *d_out,
-                                    size_t *n_out);
-std::unique_ptr<int[]> ivecs_read(const char *fname, size_t *d_out,
-                                  size_t *n_out);
\ No newline at end of file
+/// load a whole fvecs (or fbin) file without row headers. the file is split
+/// into row aligned ranges that nthreads threads pread in parallel (0 = one
+/// per core); the achieved throughput is printed.
+HugeArray<float> fvecs_read(const char *fname, size_t *d_out,
+                            size_t *n_out, int nthreads = 0);
+HugeArray<int> ivecs_read(const char *fname, size_t *d_out,
+                          size_t *n_out, int nthreads = 0);
+/// same for bvecs/u8bin, one uint8 per component (SIFT)
+HugeArray<uint8_t> bvecs_read(const char *fname, size_t *d_out,
+                              size_t *n_out, int nthreads = 0);
+/// read any supported vector file, widening integer and half precision
+/// components to float
+HugeArray<float> vecs_read_as_float(const char *fname, size_t *d_out,
+                                    size_t *n_out, int nthreads = 0);
+/// write a n * d matrix in the big-ann-benchmarks layout
+void fbin_save(const char *fname, size_t d, size_t n, const float *x);
+void u8bin_save(const char *fname, size_t d, size_t n, const uint8_t *x);
+
+/// read-only memory mapping of a vector file (see VecsLayout).
+///
+/// rows stay in place in the page cache, so opening a file costs no copy.
+/// consumers that need a contiguous headerless float matrix (faiss)
+/// materialize it block by block with copy_rows(), which is also where
+/// integer and fp16/bf16 components get widened to float. fbin files already
+/// are such a matrix and can be used in place through contiguous(). a row range
+/// [start, end) maps only that slice of the file, which then reads as a file
+/// of end - start rows, like a cut of it would (the counterpart of the Rust
+/// from_file_slice).
+///
+/// a base that is both added and searched should be mapped once with
+/// MADV_NORMAL: when it fits in the page cache it is then read from disk
+/// only once, while MADV_SEQUENTIAL pages are the first ones reclaimed after
+/// use. VecsBlockReader does the readahead either way.
+struct VecsMmap {
+  explicit VecsMmap(const char *fname, size_t start = 0, size_t end = SIZE_MAX,
+                    int advice = MADV_SEQUENTIAL);
+  ~VecsMmap();
+  VecsMmap(const VecsMmap &) = delete;
+  VecsMmap &operator=(const VecsMmap &) = delete;
+
+  const float *row(size_t i) const {
+    assert(layout.elem_size == sizeof(float));
+    return reinterpret_cast<const float *>(at(i));
+  }
+  const int *irow(size_t i) const {
+    return reinterpret_cast<const int *>(row(i));
+  }
+  const uint8_t *brow(size_t i) const {
+    assert(layout.elem_size == 1);
+    return reinterpret_cast<const uint8_t *>(at(i));
+  }
+  /// the n * d float matrix when the file stores exactly that (fbin),
+  /// nullptr otherwise
+  const float *contiguous() const {
+    return layout.bin && layout.type == VecsLayout::F32 ? row(0) : nullptr;
+  }
+  /// copy rows [i0, i0 + ni) without their headers into dst (ni * d floats)
+  void copy_rows(size_t i0, size_t ni, float *dst) const;
+  /// madvise the pages backing rows [i0, i0 + ni), clamped to the file
+  void advise(size_t i0, size_t ni, int advice) const;
+
+  VecsLayout layout;
+  size_t d = 0;
+  size_t n = 0;
+
+private:
+  /// first component of row i of the range
+  const char *at(size_t i) const {
+    return data + layout.row_offset(first + i) - map_off;
+  }
+
+  const char *data = nullptr;
+  size_t size = 0;
+  /// file offset of the mapping and file row of row 0
+  size_t map_off = 0;
+  size_t first = 0;
+};
+
+/// iterates over a mapped vecs file in blocks of at most bs headerless rows.
+///
+/// only one block is resident in the reader's buffer, so callers that add or
+/// search block by block keep their memory bounded by bs * d floats no matter
+/// how large the file is. with async set, a background task pages in and
+/// copies block i + 1 into a second buffer while the caller works on block i,
+/// so reading overlaps with faiss add/search. blocks of fbin files point
+/// straight into the mapping and are never copied.
+///
+///   VecsBlockReader reader(file, bs);
+///   while (size_t ni = reader.next())
+///     index->add(ni, reader.data());
+class VecsBlockReader {
+public:
+  /// start skips the rows before it, e.g. the ones a checkpoint has done
+  VecsBlockReader(const VecsMmap &file, size_t bs, bool async = true,
+                  size_t start = 0);
+  ~VecsBlockReader();
+
+  /// load the next block, returns its number of rows (0 once exhausted)
+  size_t next();
+  const float *data() const { return block; }
+  /// index of the first row of the current block
+  size_t i0() const { return cur; }
+
+  /// seconds next() spent waiting for data that was not read yet
+  double io_wait = 0;
+
+private:
+  void fetch(int slot);
+
+  const VecsMmap &file;
+  size_t bs;
+  bool async;
+  size_t cur = 0;
+  size_t pos = 0;
+  int front = 0;
+  const float *block = nullptr;
+  HugeArray<float> buf[2];
+  std::future<size_t> pending;
+  size_t pending_i0 = 0;
+};
+
+/// keep the real stdout for the "-" output of IvecsWriter and send
+/// everything else printed to stdout (progress logs) to stderr instead
+void reserve_stdout_for_output();
+
+/// streaming ivecs writer for results that are produced block by block.
+///
+/// every row has the same size on disk, so on a regular file a block can be
+/// written with one positioned pwrite as soon as it exists, from any thread
+/// and in any order. pipes and stdout ("-") cannot seek: there blocks are
+/// written in row order and blocks that arrive early are held back until the
+/// rows before them have been written. a .ibin output gets the (n, d) header
+/// of the big-ann-benchmarks layout and headerless rows.
+class IvecsWriter {
+public:
+  /// resume keeps the rows already in an existing output file (see
+  /// KnnCheckpoint) instead of truncating it
+  IvecsWriter(const char *fname, size_t d, size_t n, bool resume = false);
+  /// flushes the held back blocks and closes the output
+  ~IvecsWriter();
+  IvecsWriter(const IvecsWriter &) = delete;
+  IvecsWriter &operator=(const IvecsWriter &) = delete;
+
+  /// write rows [i0, i0 + ni) of the n * d id matrix, thread safe
+  void write_block(size_t i0, size_t ni, const faiss::idx_t *x);
+  /// write the rows ids[0..ni), row ids[i] coming from x + i * d, thread
+  /// safe, regular files only. the batch is converted once and sorted by id,
+  /// each run of consecutive ids is one pwritev
+  void write_rows(size_t ni, const faiss::idx_t *ids, const faiss::idx_t *x);
+  /// make the rows written so far durable (fdatasync), for regular files
+  void sync();
+
+  size_t d;
+  size_t n;
+  bool seekable;
+
+private:
+  /// the on-disk rows (with their headers) of ni rows of ids
+  std::vector<int> convert(size_t ni, const faiss::idx_t *x) const;
+  size_t row_offset(size_t i) const {
+    return (bin ? 2 * sizeof(uint32_t) : 0) + i * (d + !bin) * sizeof(int);
+  }
+  void write_all(const char *p, size_t len, off_t off);
+  /// pwritev all of iov at off, iov is consumed
+  void writev_all(std::vector<struct iovec> &iov, off_t off);
+
+  std::string fname;
+  int fd;
+  bool bin;
+  std::mutex mutex;
+  // first row not yet written and early blocks, for non seekable outputs
+  size_t next_row = 0;
+  std::map<size_t, std::vector<int>> held;
+};
+
+/// "path size mtime" of a file, to notice when an input changed between runs
+std::string file_fingerprint(const char *fname);
+
+/// path of the file for key in an index cache directory (created if needed).
+/// the key is a fingerprint of everything the cached index depends on, the
+/// file is named after its hash and a .key file next to it holds the key
+/// itself for humans
+std::string index_cache_file(const std::string &dir, const std::string &key,
+                             const char *ext);
+/// faiss::write_index to a temporary file renamed into place, so that a
+/// concurrent or crashed run never leaves a partial index under fname
+void write_index_atomic(const faiss::Index *index, const std::string &fname);
+
+/// manifest of the rows of a knn graph output that are already written, so
+/// that a build that crashed or was preempted can be resumed.
+///
+/// it lives next to the output as <output>.ckpt: a first line with a
+/// fingerprint of everything the rows depend on (inputs, index, search
+/// parameters, k), then one "i0 ni" line per block, appended once the
+/// block is durably in the output file. a block is a range of rows, or of
+/// inverted lists for the list-major self join, which writes rows out of
+/// order. an existing manifest with another fingerprint is from a different
+/// build and is ignored. blocks are searched in order, so a restart resumes
+/// at the end of the first run of finished blocks.
+///
+///   KnnCheckpoint ckpt(output, fingerprint);
+///   IvecsWriter writer(output, k, n, ckpt.start() > 0);
+///   VecsBlockReader xb(base_file, bs, true, ckpt.start());
+///   while (size_t ni = xb.next()) {
+///     ...
+///     writer.write_block(xb.i0(), ni, labels);
+///     writer.sync();
+///     ckpt.add(xb.i0(), ni);
+///   }
+///   ckpt.finish();
+class KnnCheckpoint {
+public:
+  KnnCheckpoint(const std::string &output, const std::string &fingerprint);
+  ~KnnCheckpoint();
+  KnnCheckpoint(const KnnCheckpoint &) = delete;
+  KnnCheckpoint &operator=(const KnnCheckpoint &) = delete;
+
+  /// first row (or list) that is not written yet
+  size_t start() const;
+  /// record that rows [i0, i0 + ni) are in the output
+  void add(size_t i0, size_t ni);
+  /// the graph is complete, remove the manifest
+  void finish();
+
+private:
+  std::string fname;
+  int fd = -1;
+  /// finished ranges, first row -> end row
+  std::map<size_t, size_t> done;
+};
@@ -0,0 +1,415 @@
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <faiss/utils/Heap.h>
+#include <faiss/utils/distances.h>
+#include <knn_join.h>
+#include <vector>
+
+extern "C" {
+// from the BLAS faiss is linked with
+int sgemm_(const char *transa, const char *transb, int *m, int *n, int *k,
+           const float *alpha, const float *a, int *lda, const float *b,
+           int *ldb, float *beta, float *c, int *ldc);
+}
+
+faiss::IndexIVF *ivf_of(faiss::Index *index) {
+  auto pretransform = dynamic_cast<faiss::IndexPreTransform *>(index);
+  auto ivf = dynamic_cast<faiss::IndexIVF *>(pretransform ? pretransform->index
+                                                          : index);
+  if (!ivf) {
+    fprintf(stderr, "the self join needs an IVF index\n");
+    abort();
+  }
+  return ivf;
+}
+
+SelfJoin::SelfJoin(faiss::Index *index, size_t n) : n(n), index(index) {
+  pretransform = dynamic_cast<faiss::IndexPreTransform *>(index);
+  ivf = ivf_of(index);
+  nprobe = ivf->nprobe;
+  // only an index filled by add() gets the assignment
+  if (index->ntotal == 0) {
+    lists = huge_array<int32_t>(n * nprobe);
+    coarse_dis = huge_array<float>(n * nprobe);
+  }
+}
+
+const float *SelfJoin::transform(size_t ni, const float *x,
+                                 std::unique_ptr<const float[]> &tmp) const {
+  if (!pretransform)
+    return x;
+  const float *xt = pretransform->apply_chain(ni, x);
+  if (xt != x)
+    tmp.reset(xt);
+  return xt;
+}
+
+void SelfJoin::add(size_t i0, size_t ni, const float *x) {
+  assert(lists && i0 == size_t(ivf->ntotal) && i0 + ni <= n);
+  std::unique_ptr<const float[]> tmp;
+  const float *xt = transform(ni, x, tmp);
+
+  std::vector<faiss::idx_t> assign(ni * nprobe);
+  float *dis = coarse_dis.get() + i0 * nprobe;
+  ivf->quantizer->search(ni, xt, nprobe, dis, assign.data());
+
+  // the nearest list is where the vector goes
+  std::vector<faiss::idx_t> top(ni);
+  int32_t *li = lists.get() + i0 * nprobe;
+  for (size_t i = 0; i < ni; i++) {
+    top[i] = assign[i * nprobe];
+    for (size_t j = 0; j < nprobe; j++)
+      li[i * nprobe + j] = assign[i * nprobe + j];
+  }
+  ivf->add_core(ni, xt, nullptr, top.data());
+  index->ntotal = ivf->ntotal;
+  assigned = i0 + ni == n;
+}
+
+void SelfJoin::search(size_t i0, size_t ni, const float *x, size_t k,
+                      float *D, faiss::idx_t *I, const VecsMmap *rerank_base,
+                      size_t kp) const {
+  std::unique_ptr<const float[]> tmp;
+  search_reranked(i0, nullptr, ni, transform(ni, x, tmp), k, D, I,
+                  rerank_base, x, kp);
+}
+
+void SelfJoin::search_transformed(size_t i0, const faiss::idx_t *ids,
+                                  size_t ni, const float *xt, size_t k,
+                                  float *D, faiss::idx_t *I) const {
+  std::vector<faiss::idx_t> assign(ni * nprobe);
+  std::vector<float> dis(ni * nprobe);
+  if (assigned) {
+    for (size_t i = 0; i < ni; i++) {
+      size_t row = ids ? ids[i] : i0 + i;
+      assert(row < n);
+      for (size_t j = 0; j < nprobe; j++) {
+        assign[i * nprobe + j] = lists[row * nprobe + j];
+        dis[i * nprobe + j] = coarse_dis[row * nprobe + j];
+      }
+    }
+  } else {
+    ivf->quantizer->search(ni, xt, nprobe, dis.data(), assign.data());
+  }
+
+  faiss::IVFSearchParameters params;
+  params.nprobe = nprobe;
+  ivf->search_preassigned(ni, xt, k, assign.data(), dis.data(), D, I, false,
+                          &params);
+}
+
+void SelfJoin::search_reranked(size_t i0, const faiss::idx_t *ids, size_t ni,
+                               const float *xt, size_t k, float *D,
+                               faiss::idx_t *I, const VecsMmap *rerank_base,
+                               const float *x, size_t kp) const {
+  if (!rerank_base || kp <= k) {
+    search_transformed(i0, ids, ni, xt, k, D, I);
+    return;
+  }
+  std::vector<float> cand_dis(ni * kp);
+  std::vector<faiss::idx_t> cand(ni * kp);
+  search_transformed(i0, ids, ni, xt, kp, cand_dis.data(), cand.data());
+  rerank_exact(*rerank_base, ni, x, kp, cand.data(), k, D, I);
+}
+
+void SelfJoin::enable_codes() {
+  ivf->make_direct_map(true);
+  codes = true;
+}
+
+void SelfJoin::search_codes(size_t i0, size_t ni, size_t k, float *D,
+                            faiss::idx_t *I, const VecsMmap *rerank_base,
+                            size_t kp) const {
+  size_t dt = ivf->d;
+  std::vector<float> xt(ni * dt);
+#pragma omp parallel for
+  for (size_t i = 0; i < ni; i++)
+    ivf->reconstruct(i0 + i, xt.data() + i * dt);
+
+  // only the queries themselves and the candidates are read from the base
+  std::vector<float> x;
+  if (rerank_base && kp > k) {
+    x.resize(ni * rerank_base->d);
+    rerank_base->copy_rows(i0, ni, x.data());
+  }
+  search_reranked(i0, nullptr, ni, xt.data(), k, D, I, rerank_base, x.data(),
+                  kp);
+}
+
+void SelfJoin::search_ids(size_t ni, const faiss::idx_t *ids, size_t k,
+                          float *D, faiss::idx_t *I, const VecsMmap &base,
+                          size_t kp) const {
+  bool rerank = kp > k;
+  std::vector<float> x;
+  if (!codes || rerank) {
+    x.resize(ni * base.d);
+#pragma omp parallel for
+    for (size_t i = 0; i < ni; i++)
+      base.copy_rows(ids[i], 1, x.data() + i * base.d);
+  }
+  std::unique_ptr<const float[]> tmp;
+  const float *xt;
+  std::vector<float> decoded;
+  if (codes) {
+    size_t dt = ivf->d;
+    decoded.resize(ni * dt);
+#pragma omp parallel for
+    for (size_t i = 0; i < ni; i++)
+      ivf->reconstruct(ids[i], decoded.data() + i * dt);
+    xt = decoded.data();
+  } else {
+    xt = transform(ni, x.data(), tmp);
+  }
+  search_reranked(0, ids, ni, xt, k, D, I, rerank ? &base : nullptr,
+                  x.data(), kp);
+}
+
+void SelfJoin::search_lists(size_t l0, size_t l1, size_t k, size_t bs,
+                            const VecsMmap &base, size_t kp,
+                            const ListBatchDone &done) const {
+  const faiss::InvertedLists *invlists = ivf->invlists;
+  std::vector<faiss::idx_t> batch;
+  std::vector<float> D(bs * k);
+  std::vector<faiss::idx_t> I(bs * k);
+  auto flush = [&](size_t next_list) {
+    if (batch.empty())
+      return;
+    search_ids(batch.size(), batch.data(), k, D.data(), I.data(), base, kp);
+    done(batch.size(), batch.data(), D.data(), I.data(), next_list);
+    batch.clear();
+  };
+  for (size_t l = l0; l < l1; l++) {
+    size_t ls = invlists->list_size(l);
+    const faiss::idx_t *ids = invlists->get_ids(l);
+    for (size_t j = 0; j < ls; j++) {
+      batch.push_back(ids[j]);
+      if (batch.size() == bs)
+        flush(j + 1 == ls ? l + 1 : l);
+    }
+    invlists->release_ids(l, ids);
+  }
+  flush(l1);
+}
+
+static void prefetch_row(const VecsMmap &base, faiss::idx_t id,
+                         size_t bytes) {
+  if (id < 0)
+    return;
+  const char *p = reinterpret_cast<const char *>(base.row(id));
+  for (size_t off = 0; off < bytes; off += 64)
+    __builtin_prefetch(p + off);
+}
+
+void refine_search(const faiss::Index *index, const VecsMmap &base, size_t nq,
+                   const float *x, size_t k, size_t kp, float *D,
+                   faiss::idx_t *I) {
+  if (kp <= k) {
+    index->search(nq, x, k, D, I);
+    return;
+  }
+  std::vector<float> cand_dis(nq * kp);
+  std::vector<faiss::idx_t> cand(nq * kp);
+  index->search(nq, x, kp, cand_dis.data(), cand.data());
+  rerank_exact(base, nq, x, kp, cand.data(), k, D, I);
+}
+
+void rerank_exact(const VecsMmap &base, size_t nq, const float *x, size_t kp,
+                  const faiss::idx_t *cand, size_t k, float *D,
+                  faiss::idx_t *I) {
+  size_t d = base.d;
+  // float rows are used in place, other types are widened one row at a time
+  bool in_place = base.layout.type == VecsLayout::F32;
+  // candidate rows are scattered over the base: request the lines of the
+  // row a few candidates ahead while the current one is computed
+  const size_t ahead = 4;
+  size_t row_bytes = d * base.layout.elem_size;
+#pragma omp parallel
+  {
+    std::vector<float> row(d);
+    std::vector<std::pair<float, faiss::idx_t>> dis(kp);
+#pragma omp for schedule(dynamic, 16)
+    for (size_t q = 0; q < nq; q++) {
+      const faiss::idx_t *cq = cand + q * kp;
+      if (in_place)
+        for (size_t j = 0; j < ahead && j < kp; j++)
+          prefetch_row(base, cq[j], row_bytes);
+      size_t m = 0;
+      for (size_t j = 0; j < kp; j++) {
+        if (in_place && j + ahead < kp)
+          prefetch_row(base, cq[j + ahead], row_bytes);
+        faiss::idx_t id = cq[j];
+        if (id < 0)
+          continue;
+        const float *y = row.data();
+        if (in_place)
+          y = base.row(id);
+        else
+          base.copy_rows(id, 1, row.data());
+        dis[m++] = {faiss::fvec_L2sqr(x + q * d, y, d), id};
+      }
+      size_t kk = std::min(k, m);
+      std::partial_sort(dis.begin(), dis.begin() + kk, dis.begin() + m);
+      for (size_t j = 0; j < k; j++) {
+        D[q * k + j] = j < kk ? dis[j].first : FLT_MAX;
+        I[q * k + j] = j < kk ? dis[j].second : -1;
+      }
+    }
+  }
+}
+
+CellJoin::CellJoin(faiss::Index *index, const VecsMmap &base, size_t m)
+    : m(m), ivf(ivf_of(index)), base(base) {
+  nlist = ivf->nlist;
+  std::vector<float> centroids(nlist * ivf->d);
+  ivf->quantizer->reconstruct_n(0, nlist, centroids.data());
+  std::vector<float> dis(nlist * m);
+  neighbors.resize(nlist * m);
+  ivf->quantizer->search(nlist, centroids.data(), m, dis.data(),
+                         neighbors.data());
+}
+
+void CellJoin::gather(size_t cell, std::vector<faiss::idx_t> &ids,
+                      std::vector<float> &x) const {
+  size_t ls = ivf->invlists->list_size(cell);
+  const faiss::idx_t *li = ivf->invlists->get_ids(cell);
+  ids.assign(li, li + ls);
+  ivf->invlists->release_ids(cell, li);
+  x.resize(ls * base.d);
+#pragma omp parallel for
+  for (size_t i = 0; i < ls; i++)
+    base.copy_rows(ids[i], 1, x.data() + i * base.d);
+}
+
+void CellJoin::run(size_t c0, size_t c1, size_t k,
+                   const ListBatchDone &done) const {
+  // tiles of 16 MB of inner products
+  const size_t qtile = 4096, ytile = 1024;
+  size_t d = base.d;
+  std::vector<faiss::idx_t> qids, yids;
+  std::vector<float> xq, y, qnorms, ynorms, ip(qtile * ytile);
+  std::vector<float> D;
+  std::vector<faiss::idx_t> I;
+  for (size_t c = c0; c < c1; c++) {
+    gather(c, qids, xq);
+    size_t nq = qids.size();
+    D.resize(nq * k);
+    I.resize(nq * k);
+    qnorms.resize(nq);
+    faiss::fvec_norms_L2sqr(qnorms.data(), xq.data(), d, nq);
+    for (size_t i = 0; i < nq; i++)
+      faiss::maxheap_heapify(k, D.data() + i * k, I.data() + i * k);
+
+    for (size_t j = 0; j < m && nq > 0; j++) {
+      faiss::idx_t cell = neighbors[c * m + j];
+      if (cell < 0)
+        continue;
+      gather(cell, yids, y);
+      size_t ny = yids.size();
+      ynorms.resize(ny);
+      faiss::fvec_norms_L2sqr(ynorms.data(), y.data(), d, ny);
+
+      for (size_t q0 = 0; q0 < nq; q0 += qtile) {
+        size_t nqi = std::min(qtile, nq - q0);
+        for (size_t y0 = 0; y0 < ny; y0 += ytile) {
+          size_t nyi = std::min(ytile, ny - y0);
+          knn_update_tile(d, nqi, xq.data() + q0 * d, qnorms.data() + q0, nyi,
+                          y.data() + y0 * d, ynorms.data() + y0,
+                          yids.data() + y0, 0, k, D.data() + q0 * k,
+                          I.data() + q0 * k, ip.data());
+        }
+      }
+    }
+#pragma omp parallel for
+    for (size_t i = 0; i < nq; i++)
+      faiss::maxheap_reorder(k, D.data() + i * k, I.data() + i * k);
+    done(nq, qids.data(), D.data(), I.data(), c + 1);
+  }
+}
+
+size_t CellJoin::check(size_t c, size_t ni, const faiss::idx_t *ids,
+                       size_t k, const float *D) const {
+  std::vector<faiss::idx_t> cand;
+  for (size_t j = 0; j < m; j++) {
+    faiss::idx_t cell = neighbors[c * m + j];
+    if (cell < 0)
+      continue;
+    size_t ls = ivf->invlists->list_size(cell);
+    const faiss::idx_t *li = ivf->invlists->get_ids(cell);
+    cand.insert(cand.end(), li, li + ls);
+    ivf->invlists->release_ids(cell, li);
+  }
+  std::vector<float> x(ni * base.d);
+  for (size_t i = 0; i < ni; i++)
+    base.copy_rows(ids[i], 1, x.data() + i * base.d);
+  return knn_check_exact(base, ni, x.data(), cand.size(), cand.data(), k, D);
+}
+
+void knn_update_tile(size_t d, size_t nq, const float *xq, const float *qn,
+                     size_t ny, const float *y, const float *yn,
+                     const faiss::idx_t *yids, faiss::idx_t y0, size_t k,
+                     float *D, faiss::idx_t *I, float *ip) {
+  // ip[i * ny + j] = -2 <q_i, y_j>, BLAS threads itself
+  int di = d, nqi = nq, nyi = ny;
+  float alpha = -2, beta = 0;
+  sgemm_("Transpose", "Not transpose", &nyi, &nqi, &di, &alpha, y, &di, xq,
+         &di, &beta, ip, &nyi);
+#pragma omp parallel for
+  for (size_t i = 0; i < nq; i++) {
+    float *Di = D + i * k;
+    faiss::idx_t *Ii = I + i * k;
+    const float *ipi = ip + i * ny;
+    for (size_t j = 0; j < ny; j++) {
+      float dis = qn[i] + yn[j] + ipi[j];
+      // the expansion can go slightly negative for near duplicates
+      if (dis < 0)
+        dis = 0;
+      if (dis < Di[0])
+        faiss::maxheap_replace_top(k, Di, Ii, dis, yids ? yids[j] : y0 + j);
+    }
+  }
+}
+
+size_t knn_check_exact(const VecsMmap &base, size_t nq, const float *x,
+                       size_t nc, const faiss::idx_t *cand, size_t k,
+                       const float *D) {
+  size_t d = base.d;
+  size_t n = cand ? nc : base.n;
+  bool in_place = base.layout.type == VecsLayout::F32;
+  size_t wrong = 0;
+#pragma omp parallel
+  {
+    std::vector<float> row(d), Dq(k);
+    std::vector<faiss::idx_t> Iq(k);
+#pragma omp for schedule(dynamic) reduction(+ : wrong)
+    for (size_t q = 0; q < nq; q++) {
+      const float *xq = x + q * d;
+      faiss::maxheap_heapify(k, Dq.data(), Iq.data());
+      for (size_t j = 0; j < n; j++) {
+        faiss::idx_t id = cand ? cand[j] : j;
+        const float *y = row.data();
+        if (in_place)
+          y = base.row(id);
+        else
+          base.copy_rows(id, 1, row.data());
+        float dis = faiss::fvec_L2sqr(xq, y, d);
+        if (dis < Dq[0])
+          faiss::maxheap_replace_top(k, Dq.data(), Iq.data(), dis, id);
+      }
+      faiss::maxheap_reorder(k, Dq.data(), Iq.data());
+      // |q|^2 + |y|^2 - 2 <q, y> loses about that much to float rounding
+      float qn = faiss::fvec_norm_L2sqr(xq, d);
+      for (size_t j = 0; j < k; j++) {
+        float tol = 1e-4f * (qn + Dq[j]);
+        if (std::fabs(D[q * k + j] - Dq[j]) > tol) {
+          wrong++;
+          break;
+        }
+      }
+    }
+  }
+  return wrong;
+}
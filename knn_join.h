@@ -0,0 +1,192 @@
+#pragma once
+#include <common.h>
+#include <faiss/IndexIVF.h>
+#include <faiss/IndexPreTransform.h>
+#include <functional>
+
+/// called with each batch of the list-major joins: the rows it searched and
+/// their neighbors, and the first list that is not completely searched yet
+using ListBatchDone =
+    std::function<void(size_t ni, const faiss::idx_t *ids, const float *D,
+                       const faiss::idx_t *I, size_t next_list)>;
+
+/// the IVF index of an index_factory result, which may be behind an
+/// IndexPreTransform. aborts if there is none
+faiss::IndexIVF *ivf_of(faiss::Index *index);
+
+/// self-join of an IVF index with the base vectors it was built from.
+///
+/// when the queries are the base itself, everything faiss computes for a
+/// vector when adding it (the OPQ rotation, the coarse quantization) is
+/// computed a second time when searching for its neighbors. SelfJoin keeps
+/// the nprobe nearest lists of every vector from add time and searches with
+/// them through search_preassigned, so the coarse quantizer runs once per
+/// vector. the rotation is not kept (it is as large as the base) but
+/// recomputed per block, a single small matrix product.
+///
+///   SelfJoin join(index, nb);           // after the search parameters are set
+///   while (size_t ni = xb.next())
+///     join.add(xb.i0(), ni, xb.data());
+///   ...
+///   join.search(i0, ni, x, k, D, I);    // rows [i0, i0 + ni) of the base
+///
+/// the assignment costs nb * nprobe * 8 bytes. an index that was not filled
+/// through add() (loaded from a cache) has none and search() assigns each
+/// block itself.
+///
+/// search_codes() goes one step further and does not need the base at all:
+/// the queries are decoded from the PQ codes of the index, which is as
+/// exact as the codes the neighbors are compared with anyway. an optional
+/// exact rerank of more candidates reads back only the rows it needs.
+///
+/// search_lists() changes the order: instead of base order, where
+/// consecutive queries probe unrelated lists, the rows are taken list by
+/// list from the inverted lists themselves. a batch then mostly probes the
+/// same few lists, which stay in cache together with their LUTs, and the
+/// results come out of row order.
+class SelfJoin {
+public:
+  /// index must be an IVF index, optionally behind an IndexPreTransform. the
+  /// nprobe of the IVF index at this point is the one used by add and search
+  SelfJoin(faiss::Index *index, size_t n);
+
+  /// index->add() of base rows [i0, i0 + ni), in order, also recording
+  /// their coarse assignment
+  void add(size_t i0, size_t ni, const float *x);
+  /// k nearest neighbors of base rows [i0, i0 + ni), x holds those rows.
+  /// with a rerank_base, kp candidates are reranked as in refine_search
+  void search(size_t i0, size_t ni, const float *x, size_t k, float *D,
+              faiss::idx_t *I, const VecsMmap *rerank_base = nullptr,
+              size_t kp = 0) const;
+
+  /// build the direct map that search_codes needs to find the code of a row
+  void enable_codes();
+  /// same as search, but the queries are decoded from the codes the index
+  /// stores for those rows, so the float base is not read. the distances are
+  /// then between approximations of both sides. with a rerank_base, the kp
+  /// nearest by code are reranked with exact distances to the base rows
+  void search_codes(size_t i0, size_t ni, size_t k, float *D, faiss::idx_t *I,
+                    const VecsMmap *rerank_base = nullptr,
+                    size_t kp = 0) const;
+  /// same for the rows ids[0..ni), taken from base, or decoded from their
+  /// codes once enable_codes() was called, then reranked against base when
+  /// kp > k
+  void search_ids(size_t ni, const faiss::idx_t *ids, size_t k, float *D,
+                  faiss::idx_t *I, const VecsMmap &base, size_t kp = 0) const;
+
+  /// search the rows stored in lists [l0, l1) list-major, in batches of at
+  /// most bs rows, like search_ids
+  void search_lists(size_t l0, size_t l1, size_t k, size_t bs,
+                    const VecsMmap &base, size_t kp,
+                    const ListBatchDone &done) const;
+
+  faiss::IndexPreTransform *pretransform = nullptr;
+  faiss::IndexIVF *ivf = nullptr;
+  size_t n;
+  size_t nprobe;
+
+private:
+  /// x through the pretransform chain, tmp owns the result if it is a copy
+  const float *transform(size_t ni, const float *x,
+                         std::unique_ptr<const float[]> &tmp) const;
+
+  /// search_preassigned on rows already in the IVF space, row i is ids[i],
+  /// or i0 + i without ids
+  void search_transformed(size_t i0, const faiss::idx_t *ids, size_t ni,
+                          const float *xt, size_t k, float *D,
+                          faiss::idx_t *I) const;
+  /// search xt and rerank kp candidates against the base rows x
+  void search_reranked(size_t i0, const faiss::idx_t *ids, size_t ni,
+                       const float *xt, size_t k, float *D, faiss::idx_t *I,
+                       const VecsMmap *rerank_base, const float *x,
+                       size_t kp) const;
+
+  faiss::Index *index;
+  bool assigned = false;
+  bool codes = false;
+  /// nprobe nearest lists of each row and the distances to their centroids
+  HugeArray<int32_t> lists;
+  HugeArray<float> coarse_dis;
+};
+
+/// index->search() followed by an exact refine stage: the kp > k nearest by
+/// the index' (approximate) distance are reranked with rerank_exact and the
+/// true k nearest of them are kept. the ranking of PQ distances is what
+/// limits the recall of the graph at a given nprobe, reranking a few more
+/// candidates is usually cheaper than probing more lists
+void refine_search(const faiss::Index *index, const VecsMmap &base, size_t nq,
+                   const float *x, size_t k, size_t kp, float *D,
+                   faiss::idx_t *I);
+
+/// replace the kp candidates per query of cand (-1 for none) by the k nearest
+/// of them by exact L2 distance to the rows of base. x holds the nq queries,
+/// D and I receive nq * k results sorted by distance. fvec_L2sqr is faiss'
+/// SIMD kernel; the candidate rows are prefetched a few ahead
+void rerank_exact(const VecsMmap &base, size_t nq, const float *x, size_t kp,
+                  const faiss::idx_t *cand, size_t k, float *D,
+                  faiss::idx_t *I);
+
+/// exact self join restricted to neighboring IVF cells.
+///
+/// the true neighbors of a base point almost all sit in its own cell or in
+/// the cells next to it. CellJoin takes the rows of one cell at a time as
+/// queries and compares them with the rows of the m cells whose centroids
+/// are nearest to that cell's centroid (the cell itself included). the
+/// distances of a tile of queries to a tile of rows are one sgemm of the raw
+/// floats, -2 <q, y>, plus the squared norms of both sides. each query keeps
+/// a faiss max-heap of its k nearest.
+///
+/// memory is bounded by the heaps of one cell, the float rows of two whole
+/// cells (the query cell and the neighbor it is compared with) and one tile
+/// of inner products, so it grows with the largest cell. rows are gathered
+/// by id from the mapped base, a cell is read once per neighboring cell (m
+/// times over the run) and results come out per cell, like search_lists.
+class CellJoin {
+public:
+  CellJoin(faiss::Index *index, const VecsMmap &base, size_t m);
+
+  /// k nearest neighbors of the rows of cells [c0, c1)
+  void run(size_t c0, size_t c1, size_t k, const ListBatchDone &done) const;
+  /// number of the first ni rows of cell c, ids and D as run() passed them
+  /// to done, whose neighbors are not the exact k nearest of the m
+  /// neighboring cells, see knn_check_exact
+  size_t check(size_t c, size_t ni, const faiss::idx_t *ids, size_t k,
+               const float *D) const;
+
+  size_t nlist;
+  size_t m;
+
+private:
+  /// ids and float rows of a cell
+  void gather(size_t cell, std::vector<faiss::idx_t> &ids,
+              std::vector<float> &x) const;
+
+  const faiss::IndexIVF *ivf;
+  const VecsMmap &base;
+  /// m nearest cells of each cell, nlist * m
+  std::vector<faiss::idx_t> neighbors;
+};
+
+/// add the exact squared L2 distances between the nq queries xq and the ny
+/// rows y to the max-heaps D, I (nq * k, faiss::maxheap_heapify'ed). qn and
+/// yn are the squared norms of both sides, row j of y has id yids[j], or
+/// y0 + j without yids. one sgemm of -2 <q, y> into the scratch ip (nq * ny
+/// floats) on the calling thread, which BLAS threads itself, then the heaps
+/// are updated by an OpenMP loop over the queries. as in faiss'
+/// exhaustive_L2sqr_blas, call it from outside of parallel regions and
+/// with large tiles, so that a pthreads BLAS is not called by every OpenMP
+/// thread at once
+void knn_update_tile(size_t d, size_t nq, const float *xq, const float *qn,
+                     size_t ny, const float *y, const float *yn,
+                     const faiss::idx_t *yids, faiss::idx_t y0, size_t k,
+                     float *D, faiss::idx_t *I, float *ip);
+
+/// number of the nq queries x whose sorted k nearest distances D differ
+/// from a brute-force search with fvec_L2sqr over the rows cand[0..nc) of
+/// base, or over all its rows without cand. distances rather than ids are
+/// compared, so that ties do not count, with a tolerance for the rounding
+/// of the norm expansion knn_update_tile uses. for checking a few queries,
+/// each one costs a scan of all the candidates
+size_t knn_check_exact(const VecsMmap &base, size_t nq, const float *x,
+                       size_t nc, const faiss::idx_t *cand, size_t k,
+                       const float *D);
@@ -14,6 +14,7 @@
 #include <cstring>
 #include <faiss/AutoTune.h>
 #include <faiss/index_factory.h>
+#include <knn_join.h>
 #include <memory>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -54,15 +55,37 @@ int main(int argc, char **argv) {
   std::string ground_truth;
   app.add_option("-g,--ground_truth", ground_truth, "ground truth file path");
   std::string output;
-  app.add_option("-o,--output", output, "output file path");
+  app.add_option("-o,--output", output, "output file path, - for stdout");
+  size_t block_size = 1 << 18;
+  app.add_option("--block-size", block_size,
+                 "rows read per block when adding and searching");
+  size_t knn_block = 1 << 16;
+  app.add_option("--knn-block", knn_block,
+                 "base rows searched per block when building the knn graph, "
+                 "bounds the result memory to knn-block * k");
+  bool huge_pages = true;
+  app.add_flag("--huge-pages,!--no-huge-pages", huge_pages,
+               "back the query and result matrices with huge pages");
+  size_t rerank = 0;
+  app.add_option("--rerank", rerank,
+                 "rerank this many candidates per query with exact "
+                 "distances to the base (0 = no rerank)");
 
   CLI11_PARSE(app, argc, argv);
+  // the graph goes to stdout, keep the logs out of it
+  if (output == "-")
+    reserve_stdout_for_output();
 
   std::cout << "train: " << train << std::endl;
   std::cout << "base: " << base << std::endl;
   std::cout << "query: " << query << std::endl;
   std::cout << "ground_truth: " << ground_truth << std::endl;
   std::cout << "output: " << output << std::endl;
+  std::cout << "block_size: " << block_size << std::endl;
+  std::cout << "knn_block: " << knn_block << std::endl;
+  std::cout << "huge_pages: " << huge_pages << std::endl;
+  std::cout << "rerank: " << rerank << std::endl;
+  set_huge_pages(huge_pages);
 
   double t0 = elapsed();
 
@@ -88,8 +111,9 @@ int main(int argc, char **argv) {
   {
     printf("[%.3f s] Loading train set\n", elapsed() - t0);
 
+    // all of it, the train set is small next to the base
     size_t nt;
-    auto xt = fvecs_read(train.c_str(), &d, &nt);
+    auto xt = vecs_read_as_float(train.c_str(), &d, &nt);
 
     printf("[%.3f s] Preparing index \"%s\" d=%ld\n", elapsed() - t0, index_key,
            d);
@@ -99,35 +123,39 @@ int main(int argc, char **argv) {
 
     index->train(nt, xt.get());
   }
+  // mapped once for the add and the knn graph, see VecsMmap
+  printf("[%.3f s] Loading database\n", elapsed() - t0);
+  VecsMmap base_file(base.c_str(), 0, SIZE_MAX, MADV_NORMAL);
+  assert(d == base_file.d ||
+         !"dataset does not have same dimension as train set");
+
   // add base
   {
-    printf("[%.3f s] Loading database\n", elapsed() - t0);
-
-    size_t nb, d2;
-    auto xb = fvecs_read(base.c_str(), &d2, &nb);
-    assert(d == d2 || !"dataset does not have same dimension as train set");
+    size_t nb = base_file.n;
 
     printf("[%.3f s] Indexing database, size %ld*%ld\n", elapsed() - t0, nb, d);
 
-    index->add(nb, xb.get());
+    // the base stays in the page cache, only one headerless block is copied
+    VecsBlockReader xb(base_file, block_size);
+    while (size_t ni = xb.next())
+      index->add(ni, xb.data());
   }
 
   // read query
   auto total = index->ntotal;
   printf("total: %ld\n", total);
   size_t nq;
-  std::unique_ptr<float[]> xq;
+  HugeArray<float> xq;
   {
     printf("[%.3f s] Loading queries\n", elapsed() - t0);
 
     size_t d2;
-    xq = fvecs_read(query.c_str(), &d2, &nq);
+    xq = vecs_read_as_float(query.c_str(), &d2, &nq);
     assert(d == d2 || !"query does not have same dimension as train set");
   }
 
   size_t k; // nb of results per query in the GT
-  std::unique_ptr<faiss::idx_t[]>
-      gt; // nq * k matrix of ground-truth nearest-neighbors
+  HugeArray<faiss::idx_t> gt; // nq * k matrix of ground-truth nearest-neighbors
   // read ground truth
   {
     printf("[%.3f s] Loading ground truth for %ld queries\n", elapsed() - t0,
@@ -138,7 +166,7 @@ int main(int argc, char **argv) {
     auto gt_int = ivecs_read(ground_truth.c_str(), &k, &nq2);
     assert(nq2 == nq || !"incorrect nb of ground truth entries");
 
-    gt = std::unique_ptr<faiss::idx_t[]>(new faiss::idx_t[k * nq]);
+    gt = huge_array<faiss::idx_t>(k * nq);
     for (size_t i = 0; i < k * nq; i++) {
       gt.get()[i] = gt_int[i];
     }
@@ -193,10 +221,10 @@ int main(int argc, char **argv) {
     printf("[%.3f s] Perform a search on %ld queries\n", elapsed() - t0, nq);
 
     // output buffers
-    auto I = std::unique_ptr<faiss::idx_t[]>(new faiss::idx_t[nq * k]);
-    auto D = std::unique_ptr<float[]>(new float[nq * k]);
+    auto I = huge_array<faiss::idx_t>(nq * k);
+    auto D = huge_array<float>(nq * k);
 
-    index->search(nq, xq.get(), k, D.get(), I.get());
+    refine_search(index, base_file, nq, xq.get(), k, rerank, D.get(), I.get());
 
     printf("[%.3f s] Compute recalls\n", elapsed() - t0);
 
@@ -221,14 +249,18 @@ int main(int argc, char **argv) {
   }
   // build knn for all base and save ivecs
   {
-    auto labels = std::unique_ptr<faiss::idx_t[]>(new faiss::idx_t[total * k]);
-    auto distances = std::unique_ptr<float[]>(new float[total * k]);
-    printf("[%.3f s] Loading database\n", elapsed() - t0);
-    size_t nb, d2;
-    auto xb = fvecs_read(base.c_str(), &d2, &nb);
-    assert(d == d2 || !"dataset does not have same dimension as train set");
-    index->search(nb, xb.get(), k, distances.get(), labels.get());
-    ivecs_save(output.c_str(), k, total, labels.get());
+    // faiss also returns the distances, they are not written
+    auto labels = huge_array<faiss::idx_t>(knn_block * k);
+    auto distances = huge_array<float>(knn_block * k);
+    printf("[%.3f s] Searching the database\n", elapsed() - t0);
+    // each block of neighbors is written out as soon as it is found
+    IvecsWriter writer(output.c_str(), k, total);
+    VecsBlockReader xb(base_file, knn_block);
+    while (size_t ni = xb.next()) {
+      refine_search(index, base_file, ni, xb.data(), k, rerank,
+                    distances.get(), labels.get());
+      writer.write_block(xb.i0(), ni, labels.get());
+    }
   }
   delete index;
   return 0;
@@ -6,6 +6,7 @@
  */
 
 #include <CLI11.hpp>
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <common.h>
@@ -14,6 +15,8 @@
 #include <cstring>
 #include <faiss/AutoTune.h>
 #include <faiss/index_factory.h>
+#include <faiss/index_io.h>
+#include <knn_join.h>
 #include <memory>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -38,6 +41,50 @@ double elapsed() {
   gettimeofday(&tv, nullptr);
   return tv.tv_sec + tv.tv_usec * 1e-6;
 }
+// write over a buffer larger than the last level cache, so that what a
+// search touches next comes from memory
+static void evict_caches() {
+  const size_t n = size_t(1) << 27; // 512 MB of floats
+  static auto buf = huge_array<float>(n);
+#pragma omp parallel for
+  for (size_t i = 0; i < n; i += 16)
+    buf[i] = i;
+}
+
+// one knn block searched as the self search does without --schedule list
+// (the contiguous rows [0, n) of the base, in base order) against one batch
+// of search_lists (the first n rows of the inverted lists), both cold
+static void bench_list_schedule(const SelfJoin &join, const VecsMmap &base,
+                                bool codes, size_t k, size_t n, size_t kp,
+                                float *D, faiss::idx_t *I) {
+  VecsBlockReader xb(base, n, false);
+  if (!codes)
+    xb.next();
+  evict_caches();
+  double ts = elapsed();
+  if (codes)
+    join.search_codes(0, n, k, D, I, kp ? &base : nullptr, kp);
+  else
+    join.search(0, n, xb.data(), k, D, I, &base, kp);
+  double t_query = elapsed() - ts;
+
+  std::vector<faiss::idx_t> batch;
+  const faiss::InvertedLists *invlists = join.ivf->invlists;
+  for (size_t l = 0; l < join.ivf->nlist && batch.size() < n; l++) {
+    size_t ls = invlists->list_size(l);
+    const faiss::idx_t *ids = invlists->get_ids(l);
+    for (size_t j = 0; j < ls && batch.size() < n; j++)
+      batch.push_back(ids[j]);
+    invlists->release_ids(l, ids);
+  }
+  evict_caches();
+  ts = elapsed();
+  join.search_ids(batch.size(), batch.data(), k, D, I, base, kp);
+  double t_list = elapsed() - ts;
+  printf("On %ld rows: base order %.0f qps, list order %.0f qps, %.2fx\n", n,
+         n / t_query, batch.size() / t_list, t_query / t_list);
+}
+
 // const char *TRAIN = "dataset/sift_100M/sift_100M_query_100K.fvecs";
 // const char *BASE = "dataset/sift_100M/sift_100M_train_1M.fvecs";
 // const char *QUERY = "dataset/sift_100M/sift_100M_query_100K.fvecs";
@@ -46,7 +93,9 @@ int main(int argc, char **argv) {
   CLI::App app("Faiss build knn");
   argv = app.ensure_utf8(argv);
   std::string train;
-  app.add_option("-t,--train", train, "train file path");
+  app.add_option("-t,--train", train,
+                 "train file path, not needed with an existing "
+                 "--trained-index");
   std::string base;
   app.add_option("-b,--base", base, "base file path");
   std::string query;
@@ -54,15 +103,128 @@ int main(int argc, char **argv) {
   std::string ground_truth;
   app.add_option("-g,--ground_truth", ground_truth, "ground truth file path");
   std::string output;
-  app.add_option("-o,--output", output, "output file path");
+  app.add_option("-o,--output", output, "output file path, - for stdout");
+  size_t block_size = 1 << 18;
+  app.add_option("--block-size", block_size,
+                 "rows read per block when adding and searching");
+  size_t knn_block = 1 << 16;
+  app.add_option("--knn-block", knn_block,
+                 "base rows searched per block when building the knn graph, "
+                 "bounds the result memory to knn-block * k");
+  std::string base_range;
+  app.add_option("--base-range", base_range,
+                 "start:end, only use these rows of the base file");
+  bool huge_pages = true;
+  app.add_flag("--huge-pages,!--no-huge-pages", huge_pages,
+               "back the query and result matrices with huge pages");
+  bool numa = false;
+  app.add_flag("--numa", numa,
+               "interleave the index, the results and the base pages read "
+               "from now on over the NUMA nodes and pin the search threads "
+               "to them. a base already in the page cache keeps its "
+               "placement, evict it first to interleave it");
+  std::string index_cache;
+  app.add_option("--index-cache", index_cache,
+                 "directory of populated indexes, reused by runs on the same "
+                 "train and base files");
+  bool index_mmap = false;
+  app.add_flag("--index-mmap", index_mmap,
+               "map the inverted lists of a cached index instead of reading "
+               "them");
+  std::string trained_index;
+  app.add_option("--trained-index", trained_index,
+                 "trained empty index, loaded instead of training when it "
+                 "exists and written after training otherwise");
+  std::string self_join = "search";
+  app.add_option("--self-join", self_join,
+                 "how the knn graph is searched: search (like any query), "
+                 "preassigned (reuse the coarse assignment of add), codes "
+                 "(also decode the queries from the index) or cells (exact "
+                 "distances between neighboring IVF cells)")
+      ->check(CLI::IsMember({"search", "preassigned", "codes", "cells"}));
+  size_t cell_neighbors = 0;
+  app.add_option("--cell-neighbors", cell_neighbors,
+                 "with --self-join cells, number of nearest cells each cell "
+                 "is joined with (0 = nprobe)");
+  size_t check_cells = 0;
+  app.add_option("--check-cells", check_cells,
+                 "with --self-join cells, compare the neighbors of the first "
+                 "n rows with a brute-force search of the same cells and "
+                 "exit with 1 if they differ");
+  std::string schedule = "query";
+  app.add_option("--schedule", schedule,
+                 "order of the self search with --self-join preassigned or "
+                 "codes: query (base order) or list (inverted list by list)")
+      ->check(CLI::IsMember({"query", "list"}));
+  bool bench_schedule = false;
+  app.add_flag("--bench-schedule", bench_schedule,
+               "with --schedule list, first time one knn block in base order "
+               "against one list-major batch of the same size, both with "
+               "cold caches");
+  size_t rerank = 0;
+  app.add_option("--rerank", rerank,
+                 "rerank this many candidates per query with exact "
+                 "distances to the base (0 = no rerank)");
 
   CLI11_PARSE(app, argc, argv);
+  // the graph goes to stdout, keep the logs out of it
+  if (output == "-")
+    reserve_stdout_for_output();
 
   std::cout << "train: " << train << std::endl;
   std::cout << "base: " << base << std::endl;
   std::cout << "query: " << query << std::endl;
   std::cout << "ground_truth: " << ground_truth << std::endl;
   std::cout << "output: " << output << std::endl;
+  std::cout << "block_size: " << block_size << std::endl;
+  std::cout << "knn_block: " << knn_block << std::endl;
+  std::cout << "base_range: " << base_range << std::endl;
+  std::cout << "huge_pages: " << huge_pages << std::endl;
+  set_huge_pages(huge_pages);
+  std::cout << "numa: " << numa << std::endl;
+  std::cout << "index_cache: " << index_cache << std::endl;
+  std::cout << "trained_index: " << trained_index << std::endl;
+  std::cout << "self_join: " << self_join << std::endl;
+  std::cout << "rerank: " << rerank << std::endl;
+  std::cout << "schedule: " << schedule << std::endl;
+  std::cout << "cell_neighbors: " << cell_neighbors << std::endl;
+  std::cout << "check_cells: " << check_cells << std::endl;
+  std::cout << "bench_schedule: " << bench_schedule << std::endl;
+  if (schedule == "list" && self_join != "preassigned" &&
+      self_join != "codes") {
+    fprintf(stderr, "--schedule list needs --self-join preassigned or codes\n");
+    return 1;
+  }
+  // checked again on the opened output (a named pipe), but stdout is known
+  // now, before hours of training and adding
+  if ((schedule == "list" || self_join == "cells") && output == "-") {
+    fprintf(stderr, "--schedule list and --self-join cells write rows out of "
+                    "order, the output must be a regular file\n");
+    return 1;
+  }
+  // without -t, an existing trained index stands in for the train set, also
+  // in the cache keys and the checkpoint
+  if (train.empty() && (trained_index.empty() ||
+                        access(trained_index.c_str(), R_OK) != 0)) {
+    fprintf(stderr, "-t is needed unless --trained-index names an existing "
+                    "trained index\n");
+    return 1;
+  }
+  std::string train_fingerprint =
+      file_fingerprint(train.empty() ? trained_index.c_str() : train.c_str());
+  // before anything is allocated or read, so that all of it is interleaved
+  if (numa && numa_interleave()) {
+    numa_pin_threads();
+    printf("Interleaving memory over %d NUMA nodes\n", numa_node_count());
+  }
+
+  // rows of the base file to use, the whole file by default
+  size_t base_start = 0, base_end = SIZE_MAX;
+  if (!base_range.empty() &&
+      sscanf(base_range.c_str(), "%zu:%zu", &base_start, &base_end) != 2) {
+    fprintf(stderr, "--base-range must look like start:end\n");
+    return 1;
+  }
 
   double t0 = elapsed();
 
@@ -81,15 +243,52 @@ int main(int argc, char **argv) {
   // const char *index_key = "IMI2x8,PQ8+16";
   // const char *index_key = "OPQ16_64,IMI2x8,PQ8+16";
 
-  faiss::Index *index;
+  faiss::Index *index = nullptr;
 
   size_t d;
 
-  {
+  // a populated index only depends on the recipe and on the train and base
+  // data, a run that only changes the search or the output can reuse it
+  std::string index_file;
+  if (!index_cache.empty())
+    index_file = index_cache_file(
+        index_cache,
+        std::string(index_key) + " " + train_fingerprint + " " +
+            file_fingerprint(base.c_str()) + " " + base_range,
+        ".index");
+  bool cached = !index_file.empty() && access(index_file.c_str(), R_OK) == 0;
+  if (cached) {
+    printf("[%.3f s] Loading cached index %s\n", elapsed() - t0,
+           index_file.c_str());
+    index = faiss::read_index(index_file.c_str(),
+                              index_mmap ? faiss::IO_FLAG_MMAP : 0);
+    d = index->d;
+  }
+
+  // the trained empty index only depends on the recipe and the train set,
+  // so it can be populated with any cut of the base
+  std::string trained_file = trained_index;
+  if (trained_file.empty() && !index_cache.empty())
+    trained_file = index_cache_file(
+        index_cache, std::string(index_key) + " " + train_fingerprint,
+        ".trained");
+  if (!cached && !trained_file.empty() &&
+      access(trained_file.c_str(), R_OK) == 0) {
+    printf("[%.3f s] Loading trained index %s\n", elapsed() - t0,
+           trained_file.c_str());
+    index = faiss::read_index(trained_file.c_str());
+    d = index->d;
+    if (!index->is_trained || index->ntotal != 0) {
+      fprintf(stderr, "%s is not a trained empty index\n",
+              trained_file.c_str());
+      return 1;
+    }
+  } else if (!cached) {
     printf("[%.3f s] Loading train set\n", elapsed() - t0);
 
+    // the whole train file, faiss subsamples it
     size_t nt;
-    auto xt = fvecs_read(train.c_str(), &d, &nt);
+    auto xt = vecs_read_as_float(train.c_str(), &d, &nt);
 
     printf("[%.3f s] Preparing index \"%s\" d=%ld\n", elapsed() - t0, index_key,
            d);
@@ -98,36 +297,74 @@ int main(int argc, char **argv) {
     printf("[%.3f s] Training on %ld vectors\n", elapsed() - t0, nt);
 
     index->train(nt, xt.get());
+    if (!trained_file.empty()) {
+      printf("[%.3f s] Saving trained index to %s\n", elapsed() - t0,
+             trained_file.c_str());
+      write_index_atomic(index, trained_file);
+    }
+  }
+  // one mapping for the add, the self search and the rerank, see VecsMmap
+  printf("[%.3f s] Loading database\n", elapsed() - t0);
+  VecsMmap base_file(base.c_str(), base_start, base_end, MADV_NORMAL);
+  // a loaded index may have been trained on other data than this base
+  if (base_file.d != d) {
+    fprintf(stderr, "%s has d=%zu, the index has d=%zu\n", base.c_str(),
+            base_file.d, d);
+    return 1;
   }
-  // add base
-  {
-    printf("[%.3f s] Loading database\n", elapsed() - t0);
 
-    size_t nb, d2;
-    auto xb = fvecs_read(base.c_str(), &d2, &nb);
-    assert(d == d2 || !"dataset does not have same dimension as train set");
+  // nprobe must be known when adding for the self join
+  faiss::ParameterSpace params;
+  params.set_index_parameters(index, search_index);
+  std::unique_ptr<SelfJoin> join;
+  if (self_join == "preassigned" || self_join == "codes")
+    join.reset(new SelfJoin(index, base_file.n));
+
+  // add base
+  if (!cached) {
+    size_t nb = base_file.n;
 
     printf("[%.3f s] Indexing database, size %ld*%ld\n", elapsed() - t0, nb, d);
 
-    index->add(nb, xb.get());
+    // the base stays in the page cache, only one headerless block is copied
+    // and the next one is read while faiss adds the current one
+    auto numa_before = NumaStat::read();
+    VecsBlockReader xb(base_file, block_size);
+    while (size_t ni = xb.next()) {
+      if (join)
+        join->add(xb.i0(), ni, xb.data());
+      else
+        index->add(ni, xb.data());
+    }
+    printf("[%.3f s] Indexing done, %.3f s spent waiting for reads\n",
+           elapsed() - t0, xb.io_wait);
+    NumaStat::read().print_since(numa_before, "add");
+    if (!index_file.empty()) {
+      printf("[%.3f s] Saving index to %s\n", elapsed() - t0,
+             index_file.c_str());
+      write_index_atomic(index, index_file);
+    }
   }
 
   // read query
   auto total = index->ntotal;
   printf("total: %ld\n", total);
   size_t nq;
-  std::unique_ptr<float[]> xq;
+  HugeArray<float> xq;
   {
     printf("[%.3f s] Loading queries\n", elapsed() - t0);
 
     size_t d2;
-    xq = fvecs_read(query.c_str(), &d2, &nq);
-    assert(d == d2 || !"query does not have same dimension as train set");
+    xq = vecs_read_as_float(query.c_str(), &d2, &nq);
+    if (d2 != d) {
+      fprintf(stderr, "%s has d=%zu, the index has d=%zu\n", query.c_str(),
+              d2, d);
+      return 1;
+    }
   }
 
   size_t k; // nb of results per query in the GT
-  std::unique_ptr<faiss::idx_t[]>
-      gt; // nq * k matrix of ground-truth nearest-neighbors
+  HugeArray<faiss::idx_t> gt; // nq * k matrix of ground-truth nearest-neighbors
   // read ground truth
   {
     printf("[%.3f s] Loading ground truth for %ld queries\n", elapsed() - t0,
@@ -138,7 +375,7 @@ int main(int argc, char **argv) {
     auto gt_int = ivecs_read(ground_truth.c_str(), &k, &nq2);
     assert(nq2 == nq || !"incorrect nb of ground truth entries");
 
-    gt = std::unique_ptr<faiss::idx_t[]>(new faiss::idx_t[k * nq]);
+    gt = huge_array<faiss::idx_t>(k * nq);
     for (size_t i = 0; i < k * nq; i++) {
       gt.get()[i] = gt_int[i];
     }
@@ -187,17 +424,21 @@ int main(int argc, char **argv) {
 
   { // Use the found configuration to perform a search
 
-    faiss::ParameterSpace params;
-
-    params.set_index_parameters(index, search_index);
-
     printf("[%.3f s] Perform a search on %ld queries\n", elapsed() - t0, nq);
 
     // output buffers
-    auto I = std::unique_ptr<faiss::idx_t[]>(new faiss::idx_t[nq * k]);
-    auto D = std::unique_ptr<float[]>(new float[nq * k]);
-
-    index->search(nq, xq.get(), k, D.get(), I.get());
+    auto I = huge_array<faiss::idx_t>(nq * k);
+    auto D = huge_array<float>(nq * k);
+
+    TlbMissCounter tlb;
+    auto numa_before = NumaStat::read();
+    double t1 = elapsed();
+    tlb.start();
+    refine_search(index, base_file, nq, xq.get(), k, rerank, D.get(), I.get());
+    long long misses = tlb.stop();
+    printf("[%.3f s] Search took %.3f s, %lld dTLB load misses\n",
+           elapsed() - t0, elapsed() - t1, misses);
+    NumaStat::read().print_since(numa_before, "search");
 
     printf("[%.3f s] Compute recalls\n", elapsed() - t0);
 
@@ -220,16 +461,113 @@ int main(int argc, char **argv) {
     printf("R@10 = %.4f\n", n_10 / float(nq));
     printf("R@100 = %.4f\n", n_100 / float(nq));
   }
+  // rows of the cell join that were checked, and the ones that are wrong
+  size_t cells_checked = 0, cells_wrong = 0;
   // build knn for all base and save ivecs
   {
-    auto labels = std::unique_ptr<faiss::idx_t[]>(new faiss::idx_t[total * k]);
-    auto distances = std::unique_ptr<float[]>(new float[total * k]);
-    printf("[%.3f s] Loading database\n", elapsed() - t0);
-    size_t nb, d2;
-    auto xb = fvecs_read(base.c_str(), &d2, &nb);
-    assert(d == d2 || !"dataset does not have same dimension as train set");
-    index->search(nb, xb.get(), k, distances.get(), labels.get());
-    ivecs_save(output.c_str(), k, total, labels.get());
+    // --knn-block rows of results, reused for every block
+    auto labels = huge_array<faiss::idx_t>(knn_block * k);
+    auto distances = huge_array<float>(knn_block * k);
+    printf("[%.3f s] Searching the database\n", elapsed() - t0);
+    // finished blocks are recorded in <output>.ckpt, a rerun with the same
+    // arguments and inputs only searches the rows that are missing
+    std::string fingerprint = std::string(index_key) + " " + search_index +
+                              " k=" + std::to_string(k) + " " +
+                              train_fingerprint + " " +
+                              file_fingerprint(base.c_str()) + " " +
+                              base_range + " " + self_join + " rerank=" +
+                              std::to_string(rerank) + " " + schedule +
+                              " cells=" + std::to_string(cell_neighbors);
+    // the index file this run loaded or wrote: a regenerated index must not
+    // resume into rows searched with the old one
+    const std::string &index_used = index_file.empty() ? trained_file
+                                                       : index_file;
+    if (!index_used.empty())
+      fingerprint += " " + file_fingerprint(index_used.c_str());
+    KnnCheckpoint ckpt(output, fingerprint);
+    // each block of neighbors is written out as soon as it is found
+    IvecsWriter writer(output.c_str(), k, total, ckpt.start() > 0);
+    auto block_done = [&](size_t i0, size_t ni) {
+      writer.write_block(i0, ni, labels.get());
+      writer.sync();
+      ckpt.add(i0, ni);
+    };
+    TlbMissCounter tlb;
+    auto numa_before = NumaStat::read();
+    double t1 = elapsed();
+    tlb.start();
+    // the list-major joins write rows out of order and checkpoint lists
+    size_t next_done = ckpt.start();
+    auto lists_done = [&](size_t ni, const faiss::idx_t *ids, const float *,
+                          const faiss::idx_t *I, size_t next_list) {
+      writer.write_rows(ni, ids, I);
+      if (next_list > next_done) {
+        writer.sync();
+        ckpt.add(next_done, next_list - next_done);
+        next_done = next_list;
+      }
+    };
+    if ((schedule == "list" || self_join == "cells") && !writer.seekable) {
+      fprintf(stderr, "rows are written out of order, the output must be a "
+                      "regular file\n");
+      return 1;
+    }
+    // the queries come from the index, the base is only read to rerank
+    if (self_join == "codes")
+      join->enable_codes();
+    if (self_join == "cells") {
+      faiss::IndexIVF *ivf = ivf_of(index);
+      CellJoin cells(index, base_file,
+                     cell_neighbors ? cell_neighbors : ivf->nprobe);
+      // CellJoin passes the cell it just finished as next_list - 1
+      cells.run(ckpt.start(), cells.nlist, k,
+                [&](size_t ni, const faiss::idx_t *ids, const float *D,
+                    const faiss::idx_t *I, size_t next_list) {
+                  size_t nc = std::min(ni, check_cells - cells_checked);
+                  if (nc) {
+                    cells_wrong += cells.check(next_list - 1, nc, ids, k, D);
+                    cells_checked += nc;
+                  }
+                  lists_done(ni, ids, D, I, next_list);
+                });
+    } else if (schedule == "list") {
+      if (bench_schedule)
+        bench_list_schedule(*join, base_file, self_join == "codes", k,
+                            std::min<size_t>(knn_block, total), rerank,
+                            distances.get(), labels.get());
+      join->search_lists(ckpt.start(), join->ivf->nlist, k, knn_block,
+                         base_file, rerank, lists_done);
+    } else if (self_join == "codes") {
+      for (size_t i0 = ckpt.start(); i0 < size_t(total); i0 += knn_block) {
+        size_t ni = std::min<size_t>(knn_block, total - i0);
+        join->search_codes(i0, ni, k, distances.get(), labels.get(),
+                           rerank ? &base_file : nullptr, rerank);
+        block_done(i0, ni);
+      }
+    } else {
+      VecsBlockReader xb(base_file, knn_block, true, ckpt.start());
+      while (size_t ni = xb.next()) {
+        if (join)
+          join->search(xb.i0(), ni, xb.data(), k, distances.get(),
+                       labels.get(), &base_file, rerank);
+        else
+          refine_search(index, base_file, ni, xb.data(), k, rerank,
+                        distances.get(), labels.get());
+        block_done(xb.i0(), ni);
+      }
+    }
+    ckpt.finish();
+    long long misses = tlb.stop();
+    printf("[%.3f s] Self search took %.3f s, %lld dTLB load misses\n",
+           elapsed() - t0, elapsed() - t1, misses);
+    NumaStat::read().print_since(numa_before, "self search");
+  }
+  if (cells_checked) {
+    printf("%zu of %zu checked rows differ from a brute-force search of "
+           "their cells\n",
+           cells_wrong, cells_checked);
+    if (cells_wrong)
+      return 1;
   }
   delete index;
   return 0;
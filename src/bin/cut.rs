@@ -11,6 +11,6 @@ struct Cli {
 }
 fn main() {
     let cli = Cli::parse();
-    let old_fvec = Fvec::from_file_slice(&cli.file, 0, cli.size);
-    old_fvec.save(&cli.save);
+    let old_fvec = Fvec::from_path_slice(&cli.file, 0, cli.size);
+    old_fvec.save_path(&cli.save);
 }
@@ -4,6 +4,7 @@ use clap::Parser;
 use generate_faiss_knn::{
     init_logger_info,
     read_fvecs::{Fvec, Ivec},
+    stream_gt::{ground_true_streaming, Checkpoint},
 };
 use tracing::info;
 
@@ -14,6 +15,9 @@ struct Cli {
     query: PathBuf,
     k: usize,
     save: PathBuf,
+    /// base rows in memory at a time, the base is streamed in chunks
+    #[arg(long, default_value_t = 1 << 20)]
+    chunk_rows: usize,
 }
 
 fn main() {
@@ -22,11 +26,24 @@ fn main() {
     let cli = Cli::parse();
     info!("{:?}", cli);
     // let train = Fvec::from_file(&cli.train);
-    info!("load base and query");
-    let base = Fvec::from_file(&cli.base);
-    let query = Fvec::from_file(&cli.query);
-    info!("compute the ground truth");
-    let ground_true = generate_faiss_knn::ground_true(&base, &query, cli.k);
+    info!("load query");
+    let query = Fvec::from_any_path(&cli.query);
+    info!(
+        "compute the ground truth, {} base rows per chunk",
+        cli.chunk_rows
+    );
+    // partial results after each chunk, a killed run resumes from them
+    let checkpoint = cli.save.with_extension("partial");
+    let ground_true = ground_true_streaming(
+        &cli.base,
+        &query,
+        cli.k,
+        cli.chunk_rows,
+        Some(Checkpoint {
+            path: &checkpoint,
+            query_path: &cli.query,
+        }),
+    );
     let ground_truth = ground_true
         .into_iter()
         .flatten()
@@ -41,13 +58,14 @@ fn main() {
         assert_eq!(query_result.len(), cli.k);
         info!("testing topK: {:?}", query_result);
         for i in query_result.into_iter() {
-            let base_vec = base.get_node(*i as usize);
+            let base_vec = Fvec::from_any_path_slice(&cli.base, *i as usize, *i as usize + 1);
             let query_vec = query.get_node(query_id);
-            let distance = generate_faiss_knn::distance(query_vec, base_vec, base.dim);
+            let distance = generate_faiss_knn::distance(query_vec, &base_vec.data, base_vec.dim);
             info!("distance: {:?}", distance);
         }
     }
 
     ivecs.save(&cli.save);
+    std::fs::remove_file(&checkpoint).ok();
     // save it to a file
 }
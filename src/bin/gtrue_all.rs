@@ -9,6 +9,7 @@ use std::path::PathBuf;
 use generate_faiss_knn::{
     init_logger_info,
     read_fvecs::{Fvec, Ivec},
+    stream_gt::{ground_true_streaming, Checkpoint},
 };
 use tracing::info;
 
@@ -17,6 +18,8 @@ struct DatasetEntry {
     path: PathBuf,
 }
 const K: usize = 100;
+/// base rows in memory at a time, 512 MB of a 128 dimensional base
+const CHUNK_ROWS: usize = 1 << 20;
 fn main() {
     init_logger_info();
     let datasets = vec![
@@ -50,11 +53,20 @@ fn main() {
 
         info!("generate the ground truth");
         // let train = Fvec::from_file(&cli.train);
-        info!("load base and query");
-        let base = Fvec::from_file(&base_path);
-        let query = Fvec::from_file(&query_path);
+        info!("load query");
+        let query = Fvec::from_any_path(&query_path);
         info!("compute the ground truth");
-        let ground_true = generate_faiss_knn::ground_true(&base, &query, K);
+        let checkpoint = gt_path.with_extension("partial");
+        let ground_true = ground_true_streaming(
+            &base_path,
+            &query,
+            K,
+            CHUNK_ROWS,
+            Some(Checkpoint {
+                path: &checkpoint,
+                query_path: &query_path,
+            }),
+        );
         let ground_truth = ground_true
             .into_iter()
             .flatten()
@@ -69,14 +81,16 @@ fn main() {
             assert_eq!(query_result.len(), K);
             info!("testing topK: {:?}", query_result);
             for i in query_result.into_iter() {
-                let base_vec = base.get_node(*i as usize);
+                let base_vec = Fvec::from_any_path_slice(&base_path, *i as usize, *i as usize + 1);
                 let query_vec = query.get_node(query_id);
-                let distance = generate_faiss_knn::distance(query_vec, base_vec, base.dim);
+                let distance =
+                    generate_faiss_knn::distance(query_vec, &base_vec.data, base_vec.dim);
                 info!("distance: {:?}", distance);
             }
         }
 
         ivecs.save(&gt_path);
+        std::fs::remove_file(&checkpoint).ok();
         // cut the gt
         // if !gt_path.exists() {
         // info!("building: {}", gt_path.display());
@@ -1,7 +1,7 @@
 use std::path::{Path, PathBuf};
 
 use clap::Parser;
-use generate_faiss_knn::read_fvecs::{Fvec, Ivec};
+use generate_faiss_knn::read_fvecs::{Bvec, Fvec, I8vec, Ivec};
 
 #[derive(Debug, Parser)]
 struct Cli {
@@ -15,7 +15,10 @@ fn explore_dir(path: &Path) {
         if path.is_file() {
             if let Some(ext) = path.extension() {
                 let ext = ext.to_str().unwrap();
-                if ext == "fvecs" || ext == "ivecs" {
+                if matches!(
+                    ext,
+                    "fvecs" | "ivecs" | "bvecs" | "fbin" | "ibin" | "u8bin" | "i8bin"
+                ) {
                     println!("{}", path.display());
                     explore(&path);
                 }
@@ -37,6 +40,26 @@ fn explore(path: &Path) {
             println!("fvecs");
             Fvec::read_size(path)
         }
+        "bvecs" => {
+            println!("bvecs");
+            Bvec::read_size(path)
+        }
+        "fbin" => {
+            println!("fbin");
+            Fvec::read_bin_size(path)
+        }
+        "ibin" => {
+            println!("ibin");
+            Ivec::read_bin_size(path)
+        }
+        "u8bin" => {
+            println!("u8bin");
+            Bvec::read_bin_size(path)
+        }
+        "i8bin" => {
+            println!("i8bin");
+            I8vec::read_bin_size(path)
+        }
         _ => {
             panic!("unknown file extension: {}", extension);
         }
@@ -12,6 +12,6 @@ struct Cli {
 }
 fn main() {
     let cli = Cli::parse();
-    let old_fvec = Fvec::from_file_slice(&cli.file, cli.start, cli.end);
-    old_fvec.save(&cli.save);
+    let old_fvec = Fvec::from_path_slice(&cli.file, cli.start, cli.end);
+    old_fvec.save_path(&cli.save);
 }
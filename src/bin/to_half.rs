@@ -0,0 +1,35 @@
+use std::{fs::File, io::Write, path::PathBuf};
+
+use clap::Parser;
+use generate_faiss_knn::{
+    half::{write_half, HalfKind},
+    init_logger_info,
+    read_fvecs::Fvec,
+};
+use tracing::info;
+
+/// convert a fvecs/fbin file to .f16bin or .bf16bin (picked from the
+/// extension of save), streaming it in chunks of rows
+#[derive(Debug, Parser)]
+struct Cli {
+    file: PathBuf,
+    save: PathBuf,
+    #[arg(long, default_value_t = 1_000_000)]
+    chunk: usize,
+}
+fn main() {
+    init_logger_info();
+    let cli = Cli::parse();
+    let kind = HalfKind::from_path(&cli.save).expect("save must end in .f16bin or .bf16bin");
+    let (dim, num) = Fvec::path_size(&cli.file);
+    info!("converting {} rows of dim {} to {:?}", num, dim, kind);
+    let mut file = File::create(&cli.save).unwrap();
+    file.write_all(&(num as u32).to_le_bytes()).unwrap();
+    file.write_all(&(dim as u32).to_le_bytes()).unwrap();
+    for start in (0..num).step_by(cli.chunk) {
+        let end = (start + cli.chunk).min(num);
+        let chunk = Fvec::from_path_slice(&cli.file, start, end);
+        write_half(&mut file, kind, &chunk.data);
+        info!("converted {}/{}", end, num);
+    }
+}
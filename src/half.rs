@@ -0,0 +1,210 @@
+//! fp16 / bf16 vector containers (.f16bin / .bf16bin).
+//!
+//! both use the big-ann-benchmarks bin layout: a (u32 num, u32 dim) header
+//! then the contiguous num * dim matrix, with two bytes per component. they
+//! halve the size of float32 bases on disk and in the page cache and are
+//! widened back to f32 when read.
+use std::{
+    fs::File,
+    io::{Read, Seek, SeekFrom, Write},
+    path::Path,
+};
+
+use crate::read_fvecs::Fvec;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum HalfKind {
+    F16,
+    Bf16,
+}
+
+impl HalfKind {
+    /// the half precision kind stored in a path, from its extension
+    pub fn from_path(file_path: &Path) -> Option<Self> {
+        match file_path.extension().and_then(|e| e.to_str()) {
+            Some("f16bin") => Some(HalfKind::F16),
+            Some("bf16bin") => Some(HalfKind::Bf16),
+            _ => None,
+        }
+    }
+    pub fn encode(self, x: f32) -> u16 {
+        match self {
+            HalfKind::F16 => f32_to_f16(x),
+            HalfKind::Bf16 => f32_to_bf16(x),
+        }
+    }
+    pub fn decode(self, h: u16) -> f32 {
+        match self {
+            HalfKind::F16 => f16_to_f32(h),
+            HalfKind::Bf16 => bf16_to_f32(h),
+        }
+    }
+}
+
+/// round to nearest even IEEE binary16
+pub fn f32_to_f16(x: f32) -> u16 {
+    let bits = x.to_bits();
+    let sign = ((bits >> 16) & 0x8000) as u16;
+    let exp = ((bits >> 23) & 0xff) as i32;
+    let mant = bits & 0x7f_ffff;
+    if exp == 0xff {
+        // inf stays inf, nan stays a (quiet) nan
+        return sign | 0x7c00 | if mant != 0 { 0x200 } else { 0 };
+    }
+    let e = exp - 127 + 15;
+    if e >= 0x1f {
+        return sign | 0x7c00;
+    }
+    let (m, shift) = if e <= 0 {
+        // subnormal (or zero) in half precision
+        if e < -10 {
+            return sign;
+        }
+        (mant | 0x80_0000, (14 - e) as u32)
+    } else {
+        (mant, 13)
+    };
+    let mut h = m >> shift;
+    if e > 0 {
+        h |= (e as u32) << 10;
+    }
+    let rem = m & ((1 << shift) - 1);
+    let half = 1 << (shift - 1);
+    // a carry out of the mantissa correctly bumps the exponent
+    if rem > half || (rem == half && h & 1 == 1) {
+        h += 1;
+    }
+    sign | h as u16
+}
+
+pub fn f16_to_f32(h: u16) -> f32 {
+    let sign = ((h & 0x8000) as u32) << 16;
+    let exp = ((h >> 10) & 0x1f) as u32;
+    let mant = (h & 0x3ff) as u32;
+    let bits = if exp == 0x1f {
+        sign | 0x7f80_0000 | (mant << 13)
+    } else if exp != 0 {
+        sign | ((exp + 127 - 15) << 23) | (mant << 13)
+    } else if mant == 0 {
+        sign
+    } else {
+        // subnormal, renormalize the mantissa
+        let shift = mant.leading_zeros() - 21;
+        sign | ((127 - 15 + 1 - shift) << 23) | (((mant << shift) & 0x3ff) << 13)
+    };
+    f32::from_bits(bits)
+}
+
+/// round to nearest even bfloat16
+pub fn f32_to_bf16(x: f32) -> u16 {
+    let bits = x.to_bits();
+    if x.is_nan() {
+        return ((bits >> 16) | 0x40) as u16;
+    }
+    let rounding = 0x7fff + ((bits >> 16) & 1);
+    ((bits + rounding) >> 16) as u16
+}
+
+pub fn bf16_to_f32(h: u16) -> f32 {
+    f32::from_bits((h as u32) << 16)
+}
+
+impl Fvec {
+    /// return (dim, num) of a .f16bin/.bf16bin file
+    pub fn read_half_size(file_path: &Path) -> (usize, usize) {
+        let mut file = File::open(file_path).unwrap();
+        let mut header = [0u8; 8];
+        file.read_exact(&mut header).unwrap();
+        let num = u32::from_le_bytes([header[0], header[1], header[2], header[3]]);
+        let dim = u32::from_le_bytes([header[4], header[5], header[6], header[7]]);
+        (dim as usize, num as usize)
+    }
+    /// read rows [start, end) of a .f16bin/.bf16bin file, widened to f32
+    pub fn from_half_file_slice(file_path: &Path, start: usize, end: usize) -> Self {
+        let kind = HalfKind::from_path(file_path).expect("not a .f16bin/.bf16bin file");
+        let (dim, num) = Self::read_half_size(file_path);
+        assert!(end <= num);
+        assert!(start < end);
+        let mut file = File::open(file_path).unwrap();
+        file.seek(SeekFrom::Start((8 + start * dim * 2) as u64))
+            .unwrap();
+        let mut bytes = vec![0u8; (end - start) * dim * 2];
+        file.read_exact(&mut bytes).unwrap();
+        let data = bytes
+            .chunks_exact(2)
+            .map(|b| kind.decode(u16::from_le_bytes([b[0], b[1]])))
+            .collect();
+        Fvec::new(dim, end - start, data)
+    }
+    pub fn from_half_file(file_path: &Path) -> Self {
+        let (_dim, num) = Self::read_half_size(file_path);
+        Self::from_half_file_slice(file_path, 0, num)
+    }
+    /// save as .f16bin/.bf16bin, the kind comes from the extension
+    pub fn save_half(&self, file_path: &Path) {
+        let kind = HalfKind::from_path(file_path).expect("not a .f16bin/.bf16bin file");
+        let mut file = File::create(file_path).unwrap();
+        file.write_all(&(self.num as u32).to_le_bytes()).unwrap();
+        file.write_all(&(self.dim as u32).to_le_bytes()).unwrap();
+        write_half(&mut file, kind, &self.data);
+    }
+}
+
+/// append data narrowed to half precision
+pub fn write_half(file: &mut File, kind: HalfKind, data: &[f32]) {
+    let mut buffer = Vec::with_capacity(data.len() * 2);
+    for &x in data {
+        buffer.extend_from_slice(&kind.encode(x).to_le_bytes());
+    }
+    file.write_all(&buffer).unwrap();
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_f16_round_trip() {
+        // every finite half survives a trip through f32
+        for h in 0..=u16::MAX {
+            let x = f16_to_f32(h);
+            if x.is_nan() {
+                assert!(f16_to_f32(f32_to_f16(x)).is_nan());
+            } else {
+                assert_eq!(f32_to_f16(x), h, "{:#x}", h);
+            }
+        }
+        assert_eq!(f32_to_f16(1.0), 0x3c00);
+        assert_eq!(f32_to_f16(65504.0), 0x7bff);
+        assert_eq!(f32_to_f16(1e6), 0x7c00);
+        // ties go to even: 1 + 2^-11 is halfway between 1 and the next half
+        assert_eq!(f32_to_f16(1.0 + f32::powi(2.0, -11)), 0x3c00);
+        assert_eq!(f32_to_f16(5.960_464_5e-8), 0x0001);
+    }
+
+    #[test]
+    fn test_bf16() {
+        assert_eq!(f32_to_bf16(1.0), 0x3f80);
+        assert_eq!(bf16_to_f32(0x3f80), 1.0);
+        for h in [0u16, 0x3f80, 0xbf80, 0x4049, 0x7f7f] {
+            assert_eq!(f32_to_bf16(bf16_to_f32(h)), h);
+        }
+        assert!(bf16_to_f32(f32_to_bf16(f32::NAN)).is_nan());
+    }
+
+    #[test]
+    fn test_read_write_half() {
+        let fvec = Fvec::new(2, 3, vec![0.5, -1.25, 3.0, 1024.0, -0.0, 7.75]);
+        let uuid = uuid::Uuid::new_v4();
+        for ext in ["f16bin", "bf16bin"] {
+            let file_name = format!("test_{}.{}", uuid, ext);
+            let path = Path::new(&file_name);
+            fvec.save_half(path);
+            assert_eq!(std::fs::metadata(path).unwrap().len(), 8 + 6 * 2);
+            // all values are exact in both formats
+            assert_eq!(Fvec::from_half_file(path).data, fvec.data);
+            assert_eq!(Fvec::from_half_file_slice(path, 2, 3).data, vec![-0.0, 7.75]);
+            std::fs::remove_file(path).unwrap();
+        }
+    }
+}
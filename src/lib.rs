@@ -1,10 +1,17 @@
-use std::{cmp::Reverse, collections::BinaryHeap, sync::atomic::AtomicUsize};
+use std::sync::atomic::AtomicUsize;
 
 use read_fvecs::Fvec;
+use select::TopK;
 use tracing::{info, level_filters::LevelFilter};
 use tracing_subscriber::EnvFilter;
 
+pub mod half;
+pub mod l2;
 pub mod read_fvecs;
+pub mod select;
+pub mod stream_gt;
+#[cfg(test)]
+pub(crate) mod test_util;
 
 #[cxx::bridge]
 mod ffi {
@@ -28,17 +35,14 @@ pub fn init_logger_info() {
         .try_init()
         .ok();
 }
+/// L2 distances (not squared) of node to every row of base
 pub fn distance(node: &[f32], base: &[f32], dim: usize) -> Vec<f32> {
     assert!(node.len() == dim);
     assert!(base.len() % dim == 0);
-    let base_num = base.len() / dim;
-    let mut distances = Vec::with_capacity(base_num);
-    for i in 0..base_num {
-        let mut distance = 0f32;
-        for j in 0..dim {
-            distance += (node[j] - base[i * dim + j]).powi(2);
-        }
-        distances.push(distance.sqrt());
+    let mut distances = vec![0f32; base.len() / dim];
+    l2::l2_sqr_rows(node, base, &mut distances);
+    for distance in distances.iter_mut() {
+        *distance = distance.sqrt();
     }
     distances
 }
@@ -55,40 +59,109 @@ impl Ord for DistanceWithIndex {
         self.distance.partial_cmp(&other.distance).unwrap()
     }
 }
+/// base rows scored per call of the distance kernel
+const ROWS_PER_BLOCK: usize = 4096;
+
+/// the k nearest base rows of every query, with their squared L2 distances
 pub fn ground_true(base: &Fvec, query: &Fvec, k: usize) -> Vec<Vec<DistanceWithIndex>> {
     assert_eq!(base.dim, query.dim);
+    assert!(k <= base.num);
     use rayon::prelude::*;
     let remaining_jobs = AtomicUsize::new(query.num);
     let ground_true = (0..query.num)
         .into_par_iter()
-        .map(|node_id| {
-            let node = query.get_node(node_id);
-            // compute the l2 distance of node to all base nodes
-            let distances = distance(node, &base.data, base.dim);
-            let distances_with_index = distances
-                .iter()
-                .enumerate()
-                .map(|(index, &distance)| Reverse(DistanceWithIndex { distance, index }))
-                .collect::<Vec<_>>();
-            let mut bin_heap = BinaryHeap::from(distances_with_index);
-            let mut knn = Vec::with_capacity(k);
-            for _ in 0..k {
-                if let Some(Reverse(dist)) = bin_heap.pop() {
-                    knn.push(dist);
+        // one bounded selection and distance buffer per rayon worker, reused
+        // by all its queries
+        .map_init(
+            || (TopK::new(k), vec![0f32; ROWS_PER_BLOCK]),
+            |(top, distances), node_id| {
+                let node = query.get_node(node_id);
+                top.clear();
+                let block = base.dim * ROWS_PER_BLOCK;
+                for (b, rows) in base.data.chunks(block).enumerate() {
+                    let distances = &mut distances[..rows.len() / base.dim];
+                    l2::l2_sqr_rows(node, rows, distances);
+                    for (i, &distance) in distances.iter().enumerate() {
+                        top.push(distance, b * ROWS_PER_BLOCK + i);
+                    }
                 }
-            }
-            assert!(knn.len() == k);
-            let previouse = remaining_jobs.fetch_sub(1, std::sync::atomic::Ordering::SeqCst);
-            info!("remaining jobs: {}/{}", previouse - 1, query.num);
-            knn
-        })
+                let knn: Vec<_> = top
+                    .sorted()
+                    .iter()
+                    .map(|x| DistanceWithIndex {
+                        distance: x.distance,
+                        index: x.index,
+                    })
+                    .collect();
+                assert!(knn.len() == k);
+                let previouse =
+                    remaining_jobs.fetch_sub(1, std::sync::atomic::Ordering::SeqCst);
+                info!("remaining jobs: {}/{}", previouse - 1, query.num);
+                knn
+            },
+        )
         .collect();
     ground_true
 }
 
 #[cfg(test)]
 mod tests {
-    use crate::read_fvecs::Fvec;
+    use std::{cmp::Reverse, collections::BinaryHeap, time::Instant};
+
+    use crate::{
+        read_fvecs::Fvec,
+        test_util::{indices, random_fvec},
+        DistanceWithIndex,
+    };
+
+    /// the original implementation: a heap of all the distances per query
+    fn ground_true_reference(base: &Fvec, query: &Fvec, k: usize) -> Vec<Vec<DistanceWithIndex>> {
+        use rayon::prelude::*;
+        (0..query.num)
+            .into_par_iter()
+            .map(|node_id| {
+                let node = query.get_node(node_id);
+                let distances = super::distance(node, &base.data, base.dim);
+                let mut bin_heap: BinaryHeap<_> = distances
+                    .iter()
+                    .enumerate()
+                    .map(|(index, &distance)| Reverse(DistanceWithIndex { distance, index }))
+                    .collect();
+                (0..k).map(|_| bin_heap.pop().unwrap().0).collect()
+            })
+            .collect()
+    }
+
+    #[test]
+    fn test_ground_true_matches_reference() {
+        let base = random_fvec(16, 2000, 1);
+        let query = random_fvec(16, 20, 2);
+        assert_eq!(
+            indices(&super::ground_true(&base, &query, 10)),
+            indices(&ground_true_reference(&base, &query, 10))
+        );
+    }
+
+    /// cargo test --release bench_ground_true -- --ignored --nocapture
+    #[test]
+    #[ignore]
+    fn bench_ground_true() {
+        let base = random_fvec(128, 1_000_000, 1);
+        let query = random_fvec(128, 256, 2);
+        let start = Instant::now();
+        let reference = ground_true_reference(&base, &query, 100);
+        let t_reference = start.elapsed().as_secs_f64();
+        let start = Instant::now();
+        let bounded = super::ground_true(&base, &query, 100);
+        let t_bounded = start.elapsed().as_secs_f64();
+        println!(
+            "full heap: {:.1} qps, bounded top-k: {:.1} qps, {:.2}x",
+            query.num as f64 / t_reference,
+            query.num as f64 / t_bounded,
+            t_reference / t_bounded
+        );
+        assert_eq!(indices(&bounded), indices(&reference));
+    }
 
     #[test]
     fn test_ground_true() {
@@ -6,6 +6,41 @@ use std::{
 
 pub type Fvec = DataVec<f32>;
 pub type Ivec = DataVec<u32>;
+/// uint8 vectors (SIFT bvecs), a quarter of the size of the same data as fvecs
+pub type Bvec = DataVec<u8>;
+/// int8 vectors (SPACEV .i8bin)
+pub type I8vec = DataVec<i8>;
+
+/// whether a path uses the big-ann-benchmarks layout (.fbin/.ibin/.u8bin/.i8bin):
+/// a (u32 num, u32 dim) header then the contiguous num * dim matrix, instead
+/// of the per row dim header of fvecs/ivecs/bvecs
+pub fn is_bin_path(file_path: &Path) -> bool {
+    matches!(
+        file_path.extension().and_then(|e| e.to_str()),
+        Some("fbin" | "ibin" | "u8bin" | "i8bin")
+    )
+}
+
+/// component type of a vector file for Fvec::from_any_path, from its extension
+enum AnyKind {
+    F32,
+    Half,
+    U8,
+    I8,
+}
+
+impl AnyKind {
+    fn from_path(file_path: &Path) -> Self {
+        if crate::half::HalfKind::from_path(file_path).is_some() {
+            return AnyKind::Half;
+        }
+        match file_path.extension().and_then(|e| e.to_str()) {
+            Some("bvecs" | "u8bin") => AnyKind::U8,
+            Some("i8bin") => AnyKind::I8,
+            _ => AnyKind::F32,
+        }
+    }
+}
 
 pub struct DataVec<T> {
     pub data: Vec<T>,
@@ -30,66 +65,114 @@ impl<T> DataVec<T> {
         self.data.extend(other.data);
         self.num += other.num;
     }
-    /// return (dim, num)
-    pub fn read_size(file_path: &Path) -> (usize, usize) {
-        let mut file = File::open(file_path).unwrap();
-        let mut k = [0u8; 4];
-        file.read_exact(&mut k).unwrap();
-        let dim: u32 = u32::from_le_bytes(k);
-        file.seek(SeekFrom::End(0)).unwrap();
-        let fsize = file.stream_position().unwrap() as usize;
-        let num = fsize / ((dim as usize + 1) * 4);
-        (dim as usize, num)
-    }
-
     pub fn get_node(&self, node_id: usize) -> &[T] {
         &self.data[node_id * self.dim..(node_id + 1) * self.dim]
     }
 }
 pub trait ScalaData {
+    /// bytes per component on disk
+    const SIZE: usize;
     fn zero() -> Self;
-    fn from_le_bytes(bytes: [u8; 4]) -> Self;
-    fn to_le_bytes(self) -> [u8; 4];
+    fn from_le_slice(bytes: &[u8]) -> Self;
+    fn write_le(self, out: &mut [u8]);
 }
 impl ScalaData for f32 {
+    const SIZE: usize = 4;
     fn zero() -> Self {
         0.0
     }
-    fn from_le_bytes(bytes: [u8; 4]) -> Self {
-        f32::from_le_bytes(bytes)
+    fn from_le_slice(bytes: &[u8]) -> Self {
+        f32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]])
     }
-    fn to_le_bytes(self) -> [u8; 4] {
-        self.to_le_bytes()
+    fn write_le(self, out: &mut [u8]) {
+        out.copy_from_slice(&self.to_le_bytes());
     }
 }
 impl ScalaData for u32 {
+    const SIZE: usize = 4;
+    fn zero() -> Self {
+        0
+    }
+    fn from_le_slice(bytes: &[u8]) -> Self {
+        u32::from_le_bytes([bytes[0], bytes[1], bytes[2], bytes[3]])
+    }
+    fn write_le(self, out: &mut [u8]) {
+        out.copy_from_slice(&self.to_le_bytes());
+    }
+}
+impl ScalaData for i8 {
+    const SIZE: usize = 1;
+    fn zero() -> Self {
+        0
+    }
+    fn from_le_slice(bytes: &[u8]) -> Self {
+        bytes[0] as i8
+    }
+    fn write_le(self, out: &mut [u8]) {
+        out[0] = self as u8;
+    }
+}
+impl ScalaData for u8 {
+    const SIZE: usize = 1;
     fn zero() -> Self {
         0
     }
-    fn from_le_bytes(bytes: [u8; 4]) -> Self {
-        u32::from_le_bytes(bytes)
+    fn from_le_slice(bytes: &[u8]) -> Self {
+        bytes[0]
     }
-    fn to_le_bytes(self) -> [u8; 4] {
-        self.to_le_bytes()
+    fn write_le(self, out: &mut [u8]) {
+        out[0] = self;
     }
 }
 
 impl<T: ScalaData + Clone + Copy> DataVec<T> {
-    // Helper function to read data from file
+    /// bytes of one row on disk: the u32 dim header then the components
+    fn row_bytes(dim: usize) -> usize {
+        4 + dim * T::SIZE
+    }
+    /// rows of a file of fsize bytes. panics when the size is not a whole
+    /// number of rows, which is what a file of another component type (a
+    /// bvecs file read as fvecs) looks like
+    fn checked_num(file_path: &Path, fsize: usize, dim: usize) -> usize {
+        let row_bytes = Self::row_bytes(dim);
+        assert!(
+            dim > 0 && fsize % row_bytes == 0,
+            "{}: weird file size {} for rows of dim {} and {} bytes per component",
+            file_path.display(),
+            fsize,
+            dim,
+            T::SIZE
+        );
+        fsize / row_bytes
+    }
+    /// return (dim, num)
+    pub fn read_size(file_path: &Path) -> (usize, usize) {
+        let mut file = File::open(file_path).unwrap();
+        let mut k = [0u8; 4];
+        file.read_exact(&mut k).unwrap();
+        let dim: u32 = u32::from_le_bytes(k);
+        file.seek(SeekFrom::End(0)).unwrap();
+        let fsize = file.stream_position().unwrap() as usize;
+        let num = Self::checked_num(file_path, fsize, dim as usize);
+        (dim as usize, num)
+    }
+    // Helper function to read data from file, the file is positioned at the
+    // header of row start. rows are read a few MB at a time, not one by one.
     fn read_data_from_file(file: &mut File, dim: u32, start: usize, end: usize) -> Vec<T> {
-        let mut data: Vec<T> = Vec::new();
-        for _row_id in start..end {
-            file.seek(SeekFrom::Current(4)).unwrap();
-            let mut bytes = vec![0u8; dim as usize * 4];
+        let row_bytes = Self::row_bytes(dim as usize);
+        let rows_per_read = (16 << 20) / row_bytes + 1;
+        let mut data: Vec<T> = Vec::with_capacity((end - start) * dim as usize);
+        let mut bytes = Vec::new();
+        let mut row_id = start;
+        while row_id < end {
+            let rows = rows_per_read.min(end - row_id);
+            bytes.resize(rows * row_bytes, 0);
             file.read_exact(&mut bytes).unwrap();
-            let mut buffer = vec![T::zero(); dim as usize];
-
-            for (i, chunk) in bytes.chunks_exact(4).enumerate() {
-                buffer[i] = T::from_le_bytes([chunk[0], chunk[1], chunk[2], chunk[3]]);
-                // check the correctness of the fvec file
+            for row in bytes.chunks_exact(row_bytes) {
+                // skip the dim header of every row
+                data.extend(row[4..].chunks_exact(T::SIZE).map(T::from_le_slice));
             }
-
-            data.extend(buffer);
+            row_id += rows;
         }
         data
     }
@@ -101,12 +184,14 @@ impl<T: ScalaData + Clone + Copy> DataVec<T> {
         let dim: u32 = u32::from_le_bytes(k);
         file.seek(SeekFrom::End(0)).unwrap();
         let fsize = file.stream_position().unwrap() as usize;
-        let num = fsize / ((dim as usize + 1) * 4);
+        let num = Self::checked_num(file_path, fsize, dim as usize);
 
         assert!(end <= num);
         assert!(start < end);
-        file.seek(SeekFrom::Start((start * (dim as usize + 1) * 4) as u64))
-            .unwrap();
+        file.seek(SeekFrom::Start(
+            (start * Self::row_bytes(dim as usize)) as u64,
+        ))
+        .unwrap();
         let partial_num = end - start;
         data.reserve(partial_num * dim as usize);
 
@@ -126,7 +211,7 @@ impl<T: ScalaData + Clone + Copy> DataVec<T> {
         let dim: u32 = u32::from_le_bytes(k);
         file.seek(SeekFrom::End(0)).unwrap();
         let fsize = file.stream_position().unwrap() as usize;
-        let num = fsize / ((dim as usize + 1) * 4);
+        let num = Self::checked_num(file_path, fsize, dim as usize);
         data.reserve(num * dim as usize);
         file.seek(SeekFrom::Start(0)).unwrap();
 
@@ -142,18 +227,152 @@ impl<T: ScalaData + Clone + Copy> DataVec<T> {
         let mut file = File::create(file_path).unwrap();
         for i in 0..self.num {
             file.write_all(&(self.dim as u32).to_le_bytes()).unwrap();
-            let mut buffer = vec![0u8; self.dim * 4];
+            let mut buffer = vec![0u8; self.dim * T::SIZE];
             let data = self.get_node(i);
             for j in 0..self.dim {
-                let bytes = data[j].to_le_bytes();
-                buffer[j * 4..(j + 1) * 4].copy_from_slice(&bytes);
+                data[j].write_le(&mut buffer[j * T::SIZE..(j + 1) * T::SIZE]);
             }
             file.write_all(&buffer).unwrap();
         }
     }
 }
 
+impl<T: ScalaData + Clone + Copy> DataVec<T> {
+    /// return (dim, num) of a .fbin/.ibin/.u8bin/.i8bin file
+    pub fn read_bin_size(file_path: &Path) -> (usize, usize) {
+        let mut file = File::open(file_path).unwrap();
+        let mut header = [0u8; 8];
+        file.read_exact(&mut header).unwrap();
+        let num = u32::from_le_bytes([header[0], header[1], header[2], header[3]]) as usize;
+        let dim = u32::from_le_bytes([header[4], header[5], header[6], header[7]]) as usize;
+        let fsize = file.metadata().unwrap().len() as usize;
+        assert!(
+            fsize == 8 + num * dim * T::SIZE,
+            "{}: weird file size {} for {} rows of dim {} and {} bytes per component",
+            file_path.display(),
+            fsize,
+            num,
+            dim,
+            T::SIZE
+        );
+        (dim, num)
+    }
+    /// read rows [start, end) of a .fbin/.ibin/.u8bin/.i8bin file with one
+    /// contiguous read
+    pub fn from_bin_file_slice(file_path: &Path, start: usize, end: usize) -> Self {
+        let (dim, num) = Self::read_bin_size(file_path);
+        assert!(end <= num);
+        assert!(start < end);
+        let mut file = File::open(file_path).unwrap();
+        file.seek(SeekFrom::Start((8 + start * dim * T::SIZE) as u64))
+            .unwrap();
+        let mut bytes = vec![0u8; (end - start) * dim * T::SIZE];
+        file.read_exact(&mut bytes).unwrap();
+        let data = bytes.chunks_exact(T::SIZE).map(T::from_le_slice).collect();
+        Self {
+            data,
+            dim,
+            num: end - start,
+        }
+    }
+    pub fn from_bin_file(file_path: &Path) -> Self {
+        let (_dim, num) = Self::read_bin_size(file_path);
+        Self::from_bin_file_slice(file_path, 0, num)
+    }
+    pub fn save_bin(&self, file_path: &Path) {
+        let mut file = File::create(file_path).unwrap();
+        file.write_all(&(self.num as u32).to_le_bytes()).unwrap();
+        file.write_all(&(self.dim as u32).to_le_bytes()).unwrap();
+        let mut buffer = vec![0u8; self.data.len() * T::SIZE];
+        for (x, out) in self.data.iter().zip(buffer.chunks_exact_mut(T::SIZE)) {
+            x.write_le(out);
+        }
+        file.write_all(&buffer).unwrap();
+    }
+
+    /// from_file_slice or from_bin_file_slice, depending on the extension
+    pub fn from_path_slice(file_path: &Path, start: usize, end: usize) -> Self {
+        if is_bin_path(file_path) {
+            Self::from_bin_file_slice(file_path, start, end)
+        } else {
+            Self::from_file_slice(file_path, start, end)
+        }
+    }
+    /// from_file or from_bin_file, depending on the extension
+    pub fn from_path(file_path: &Path) -> Self {
+        if is_bin_path(file_path) {
+            Self::from_bin_file(file_path)
+        } else {
+            Self::from_file(file_path)
+        }
+    }
+    /// read_size or read_bin_size, depending on the extension
+    pub fn path_size(file_path: &Path) -> (usize, usize) {
+        if is_bin_path(file_path) {
+            Self::read_bin_size(file_path)
+        } else {
+            Self::read_size(file_path)
+        }
+    }
+    /// save or save_bin, depending on the extension
+    pub fn save_path(&self, file_path: &Path) {
+        if is_bin_path(file_path) {
+            self.save_bin(file_path)
+        } else {
+            self.save(file_path)
+        }
+    }
+}
+
+impl<T: Copy + Into<f32>> DataVec<T> {
+    /// widen rows [start, end) of u8 or i8 vectors to f32, so only the block
+    /// being worked on takes float space
+    pub fn to_fvec_slice(&self, start: usize, end: usize) -> Fvec {
+        assert!(start <= end);
+        assert!(end <= self.num);
+        Fvec::new(
+            self.dim,
+            end - start,
+            self.data[start * self.dim..end * self.dim]
+                .iter()
+                .map(|&x| x.into())
+                .collect(),
+        )
+    }
+    pub fn to_fvec(&self) -> Fvec {
+        self.to_fvec_slice(0, self.num)
+    }
+}
+
 impl DataVec<f32> {
+    /// read any vector file as floats: fvecs and fbin, f16bin/bf16bin, and
+    /// the integer bvecs/u8bin/i8bin, widened to f32
+    pub fn from_any_path(file_path: &Path) -> Self {
+        match AnyKind::from_path(file_path) {
+            AnyKind::Half => Self::from_half_file(file_path),
+            AnyKind::U8 => Bvec::from_path(file_path).to_fvec(),
+            AnyKind::I8 => I8vec::from_path(file_path).to_fvec(),
+            AnyKind::F32 => Self::from_path(file_path),
+        }
+    }
+    /// rows [start, end) of any vector file, like from_any_path
+    pub fn from_any_path_slice(file_path: &Path, start: usize, end: usize) -> Self {
+        match AnyKind::from_path(file_path) {
+            AnyKind::Half => Self::from_half_file_slice(file_path, start, end),
+            AnyKind::U8 => Bvec::from_path_slice(file_path, start, end).to_fvec(),
+            AnyKind::I8 => I8vec::from_path_slice(file_path, start, end).to_fvec(),
+            AnyKind::F32 => Self::from_path_slice(file_path, start, end),
+        }
+    }
+    /// (dim, num) of any vector file
+    pub fn any_path_size(file_path: &Path) -> (usize, usize) {
+        match AnyKind::from_path(file_path) {
+            AnyKind::Half => Self::read_half_size(file_path),
+            AnyKind::U8 => Bvec::path_size(file_path),
+            AnyKind::I8 => I8vec::path_size(file_path),
+            AnyKind::F32 => Self::path_size(file_path),
+        }
+    }
     pub fn get_center_point(&self) -> Vec<f32> {
         let mut center = vec![f32::default(); self.dim];
         for i in 0..self.num {
@@ -226,6 +445,62 @@ mod tests {
         std::fs::remove_file(&file_name).unwrap();
     }
 
+    #[test]
+    fn test_read_write_bvecs() {
+        let bvec = super::Bvec::new(3, 2, vec![1, 2, 3, 4, 5, 255]);
+        let uuid = uuid::Uuid::new_v4();
+        let file_name = format!("test_{}.bvecs", uuid);
+        bvec.save(std::path::Path::new(&file_name));
+        // 4 byte header and one byte per component
+        let meta = std::fs::metadata(&file_name).unwrap();
+        assert_eq!(meta.len(), 2 * (4 + 3));
+        let (dim, num) = super::Bvec::read_size(std::path::Path::new(&file_name));
+        assert_eq!(dim, 3);
+        assert_eq!(num, 2);
+        let bvec2 = super::Bvec::from_file_slice(std::path::Path::new(&file_name), 1, 2);
+        assert_eq!(bvec2.data, vec![4, 5, 255]);
+        let fvec = super::Bvec::from_file(std::path::Path::new(&file_name)).to_fvec();
+        assert_eq!(fvec.data, vec![1., 2., 3., 4., 5., 255.]);
+        // the float readers widen it instead of parsing its bytes as floats
+        let path = std::path::Path::new(&file_name);
+        assert_eq!(super::Fvec::any_path_size(path), (3, 2));
+        assert_eq!(super::Fvec::from_any_path(path).data, fvec.data);
+        assert_eq!(
+            super::Fvec::from_any_path_slice(path, 1, 2).data,
+            vec![4., 5., 255.]
+        );
+        // and the fvecs reader refuses it
+        assert!(std::panic::catch_unwind(|| super::Fvec::read_size(path)).is_err());
+        // delete the file
+        std::fs::remove_file(&file_name).unwrap();
+    }
+
+    #[test]
+    fn test_read_write_bin() {
+        let fvec = super::Fvec::new(2, 3, vec![1., 2., 3., 4., 5., 6.]);
+        let uuid = uuid::Uuid::new_v4();
+        let file_name = format!("test_{}.fbin", uuid);
+        let path = std::path::Path::new(&file_name);
+        fvec.save_path(path);
+        // 8 byte header then the raw matrix
+        assert_eq!(std::fs::metadata(path).unwrap().len(), 8 + 6 * 4);
+        assert_eq!(super::Fvec::path_size(path), (2, 3));
+        let fvec2 = super::Fvec::from_path(path);
+        assert_eq!(fvec2.data, fvec.data);
+        let fvec3 = super::Fvec::from_path_slice(path, 1, 3);
+        assert_eq!(fvec3.num, 2);
+        assert_eq!(fvec3.data, vec![3., 4., 5., 6.]);
+        std::fs::remove_file(path).unwrap();
+
+        let i8vec = super::I8vec::new(2, 2, vec![-128, -1, 0, 127]);
+        let file_name = format!("test_{}.i8bin", uuid);
+        let path = std::path::Path::new(&file_name);
+        i8vec.save_path(path);
+        assert_eq!(super::I8vec::from_path(path).data, i8vec.data);
+        // delete the file
+        std::fs::remove_file(path).unwrap();
+    }
+
     #[test]
     fn test_split() {
         let fvec = super::Fvec::new(2, 2, vec![1., 2., 3., 4.]);
@@ -0,0 +1,130 @@
+use std::cmp::Ordering;
+
+use crate::DistanceWithIndex;
+
+/// the k nearest of a stream of (distance, index) pairs, in O(k) memory.
+///
+/// candidates are appended to a buffer of 2k entries as long as they beat
+/// the current threshold. when the buffer is full, `select_nth_unstable`
+/// keeps its k nearest and their largest distance becomes the threshold, so
+/// most pushes end in a single comparison. a candidate at the threshold
+/// distance is kept only if its index is below the index of the k-th, so the
+/// result is the k smallest (distance, index) pairs whatever the order of
+/// the pushes. `clear` keeps the buffer, one `TopK` per thread serves all
+/// its queries without allocating.
+pub struct TopK {
+    k: usize,
+    buf: Vec<DistanceWithIndex>,
+    threshold: f32,
+    threshold_index: usize,
+}
+
+fn by_distance(a: &DistanceWithIndex, b: &DistanceWithIndex) -> Ordering {
+    a.distance
+        .total_cmp(&b.distance)
+        .then(a.index.cmp(&b.index))
+}
+
+impl TopK {
+    pub fn new(k: usize) -> Self {
+        assert!(k > 0);
+        Self {
+            k,
+            buf: Vec::with_capacity(2 * k),
+            threshold: f32::INFINITY,
+            threshold_index: usize::MAX,
+        }
+    }
+
+    pub fn k(&self) -> usize {
+        self.k
+    }
+
+    /// forget the candidates, for the next query
+    pub fn clear(&mut self) {
+        self.buf.clear();
+        self.threshold = f32::INFINITY;
+        self.threshold_index = usize::MAX;
+    }
+
+    /// the distance a candidate has to beat to be kept
+    #[inline]
+    pub fn threshold(&self) -> f32 {
+        self.threshold
+    }
+
+    #[inline]
+    pub fn push(&mut self, distance: f32, index: usize) {
+        if distance < self.threshold
+            || (distance == self.threshold && index < self.threshold_index)
+        {
+            self.buf.push(DistanceWithIndex { distance, index });
+            if self.buf.len() == 2 * self.k {
+                self.shrink();
+            }
+        }
+    }
+
+    fn shrink(&mut self) {
+        let k = self.k;
+        if self.buf.len() > k {
+            self.buf.select_nth_unstable_by(k - 1, by_distance);
+            self.buf.truncate(k);
+            self.threshold = self.buf[k - 1].distance;
+            self.threshold_index = self.buf[k - 1].index;
+        }
+    }
+
+    /// the (at most) k nearest, sorted by distance then index
+    pub fn sorted(&mut self) -> &[DistanceWithIndex] {
+        self.shrink();
+        self.buf.sort_unstable_by(by_distance);
+        &self.buf
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::TopK;
+    use crate::test_util::random;
+
+    #[test]
+    fn test_top_k_matches_sort() {
+        let mut seed = 42;
+        let mut top = TopK::new(10);
+        for n in [0, 5, 10, 19, 20, 21, 1000] {
+            let values: Vec<f32> = (0..n).map(|_| random(&mut seed)).collect();
+            top.clear();
+            for (i, &v) in values.iter().enumerate() {
+                top.push(v, i);
+            }
+            let mut expected: Vec<(f32, usize)> =
+                values.iter().cloned().zip(0..).collect();
+            expected.sort_by(|a, b| a.0.total_cmp(&b.0));
+            expected.truncate(10);
+            let got: Vec<(f32, usize)> =
+                top.sorted().iter().map(|x| (x.distance, x.index)).collect();
+            assert_eq!(got, expected);
+        }
+    }
+
+    #[test]
+    fn test_top_k_ties() {
+        let mut top = TopK::new(3);
+        for i in (0..10).rev() {
+            top.push(1.0, i);
+        }
+        let got: Vec<usize> = top.sorted().iter().map(|x| x.index).collect();
+        assert_eq!(got, [0, 1, 2]);
+        assert!(top.threshold() == 1.0);
+        // ties with the pushes in index order, and across a shrink
+        top.clear();
+        for i in 0..10 {
+            top.push(1.0, i);
+        }
+        top.push(0.5, 20);
+        let got: Vec<(f32, usize)> =
+            top.sorted().iter().map(|x| (x.distance, x.index)).collect();
+        assert_eq!(got, [(0.5, 20), (1.0, 0), (1.0, 1)]);
+    }
+}
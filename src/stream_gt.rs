@@ -0,0 +1,286 @@
+//! exact ground truth for bases that do not fit in memory.
+//!
+//! the base is read in chunks of rows by a reader thread, one chunk ahead of
+//! the scoring, and every query is scored against a chunk before the next
+//! one is taken. what stays in memory is at most three chunks (being read,
+//! queued, being scored) and a `TopK` of 2k candidates per query. after each
+//! chunk the k best so far are written to a checkpoint file, a run that is
+//! killed resumes after the last chunk it completed.
+
+use std::{
+    fs::File,
+    io::{BufReader, BufWriter, Read, Write},
+    path::Path,
+    sync::mpsc::sync_channel,
+    thread,
+    time::UNIX_EPOCH,
+};
+
+use rayon::prelude::*;
+use tracing::info;
+
+use crate::{l2::l2_sqr_rows, read_fvecs::Fvec, select::TopK, DistanceWithIndex};
+
+/// queries per rayon task. a task walks the chunk in blocks of BLOCK_ROWS
+/// rows and scores all its queries against a block while it is in cache
+const QUERIES_PER_TASK: usize = 16;
+/// 1024 * 128 floats, 512 KB of a SIFT chunk
+const BLOCK_ROWS: usize = 1024;
+
+/// where `ground_true_streaming` keeps its partial results
+pub struct Checkpoint<'a> {
+    pub path: &'a Path,
+    /// the file the queries were read from, the checkpoint is only valid for
+    /// the same base and query files
+    pub query_path: &'a Path,
+}
+
+/// "path size mtime" of a file, to notice when an input changed between
+/// runs, like file_fingerprint on the C++ side
+pub fn file_fingerprint(file_path: &Path) -> String {
+    let meta = std::fs::metadata(file_path).unwrap();
+    let mtime = meta.modified().unwrap().duration_since(UNIX_EPOCH).unwrap();
+    format!(
+        "{} {} {}.{:09}",
+        file_path.display(),
+        meta.len(),
+        mtime.as_secs(),
+        mtime.subsec_nanos()
+    )
+}
+
+/// the k nearest rows of the base file of every query, with their squared
+/// L2 distances, like `ground_true` but reading only chunk_rows rows of the
+/// base at a time. with a checkpoint, the partial results are saved after
+/// each chunk and loaded back first if the file exists; the caller removes
+/// it once the results are saved
+pub fn ground_true_streaming(
+    base_path: &Path,
+    query: &Fvec,
+    k: usize,
+    chunk_rows: usize,
+    checkpoint: Option<Checkpoint>,
+) -> Vec<Vec<DistanceWithIndex>> {
+    let (dim, num) = Fvec::any_path_size(base_path);
+    assert_eq!(dim, query.dim);
+    assert!(k <= num);
+    assert!(chunk_rows > 0);
+    let mut tops: Vec<TopK> = (0..query.num).map(|_| TopK::new(k)).collect();
+    let fingerprint = checkpoint.as_ref().map(|c| {
+        format!(
+            "{} {} k={}",
+            file_fingerprint(base_path),
+            file_fingerprint(c.query_path),
+            k
+        )
+    });
+    let start = match (&checkpoint, &fingerprint) {
+        (Some(c), Some(f)) if c.path.exists() => load_checkpoint(c.path, f, num, &mut tops),
+        _ => 0,
+    };
+    if start > 0 {
+        info!("resuming after {}/{} base rows", start, num);
+    }
+    let (sender, receiver) = sync_channel(1);
+    thread::scope(|s| {
+        s.spawn(move || {
+            for chunk_start in (start..num).step_by(chunk_rows) {
+                let end = (chunk_start + chunk_rows).min(num);
+                let chunk = Fvec::from_any_path_slice(base_path, chunk_start, end);
+                // the receiver is gone only if scoring panicked
+                if sender.send((chunk_start, chunk)).is_err() {
+                    break;
+                }
+            }
+        });
+        for (chunk_start, chunk) in receiver {
+            score_chunk(query, &chunk, chunk_start, &mut tops);
+            let done = chunk_start + chunk.num;
+            if let (Some(c), Some(f)) = (&checkpoint, &fingerprint) {
+                save_checkpoint(c.path, f, done, num, &mut tops);
+            }
+            info!("scored {}/{} base rows", done, num);
+        }
+    });
+    tops.iter_mut()
+        .map(|top| {
+            let knn: Vec<_> = top
+                .sorted()
+                .iter()
+                .map(|x| DistanceWithIndex {
+                    distance: x.distance,
+                    index: x.index,
+                })
+                .collect();
+            assert!(knn.len() == k);
+            knn
+        })
+        .collect()
+}
+
+/// push the rows of chunk, the base rows from chunk_start on, into the top-k
+/// of every query
+fn score_chunk(query: &Fvec, chunk: &Fvec, chunk_start: usize, tops: &mut [TopK]) {
+    let dim = query.dim;
+    tops.par_chunks_mut(QUERIES_PER_TASK)
+        .enumerate()
+        .for_each_init(
+            || vec![0f32; BLOCK_ROWS],
+            |distances, (task, tops)| {
+                for (b, rows) in chunk.data.chunks(dim * BLOCK_ROWS).enumerate() {
+                    let distances = &mut distances[..rows.len() / dim];
+                    let row0 = chunk_start + b * BLOCK_ROWS;
+                    for (q, top) in tops.iter_mut().enumerate() {
+                        let node = query.get_node(task * QUERIES_PER_TASK + q);
+                        l2_sqr_rows(node, rows, distances);
+                        for (i, &distance) in distances.iter().enumerate() {
+                            top.push(distance, row0 + i);
+                        }
+                    }
+                }
+            },
+        );
+}
+
+// checkpoint layout, all little endian: u64 rows done, the fingerprint of
+// the inputs (u64 length then utf8), u64 base rows, u64 queries, u64 k,
+// then per query a u64 count and count (f32 distance, u64 index) pairs.
+// written to a temporary file and renamed, so a checkpoint is always
+// complete
+
+fn save_checkpoint(path: &Path, fingerprint: &str, done: usize, num: usize, tops: &mut [TopK]) {
+    let tmp = path.with_extension("tmp");
+    let mut file = BufWriter::new(File::create(&tmp).unwrap());
+    let k = tops.first().map_or(0, |top| top.k());
+    file.write_all(&(done as u64).to_le_bytes()).unwrap();
+    file.write_all(&(fingerprint.len() as u64).to_le_bytes())
+        .unwrap();
+    file.write_all(fingerprint.as_bytes()).unwrap();
+    for x in [num, tops.len(), k] {
+        file.write_all(&(x as u64).to_le_bytes()).unwrap();
+    }
+    for top in tops.iter_mut() {
+        let knn = top.sorted();
+        file.write_all(&(knn.len() as u64).to_le_bytes()).unwrap();
+        for x in knn {
+            file.write_all(&x.distance.to_le_bytes()).unwrap();
+            file.write_all(&(x.index as u64).to_le_bytes()).unwrap();
+        }
+    }
+    file.into_inner().unwrap().sync_all().unwrap();
+    std::fs::rename(&tmp, path).unwrap();
+}
+
+/// fill tops from the checkpoint and return the number of base rows it
+/// covers. panics if it was written for other inputs or another k
+fn load_checkpoint(path: &Path, fingerprint: &str, num: usize, tops: &mut [TopK]) -> usize {
+    fn read_u64(file: &mut BufReader<File>) -> usize {
+        let mut bytes = [0u8; 8];
+        file.read_exact(&mut bytes).unwrap();
+        u64::from_le_bytes(bytes) as usize
+    }
+    let mut file = BufReader::new(File::open(path).unwrap());
+    let done = read_u64(&mut file);
+    let len = read_u64(&mut file);
+    assert!(
+        len < 1 << 16,
+        "{} is not a checkpoint, remove it",
+        path.display()
+    );
+    let mut written = vec![0u8; len];
+    file.read_exact(&mut written).unwrap();
+    assert_eq!(
+        String::from_utf8_lossy(&written),
+        fingerprint,
+        "{} is the checkpoint of other inputs, remove it",
+        path.display()
+    );
+    let header = [
+        read_u64(&mut file),
+        read_u64(&mut file),
+        read_u64(&mut file),
+    ];
+    let k = tops.first().map_or(0, |top| top.k());
+    assert_eq!(
+        header,
+        [num, tops.len(), k],
+        "{} is the checkpoint of another run (base rows, queries, k), remove it",
+        path.display()
+    );
+    for top in tops.iter_mut() {
+        let count = read_u64(&mut file);
+        for _ in 0..count {
+            let mut distance = [0u8; 4];
+            file.read_exact(&mut distance).unwrap();
+            let index = read_u64(&mut file);
+            top.push(f32::from_le_bytes(distance), index);
+        }
+    }
+    done
+}
+
+#[cfg(test)]
+mod tests {
+    use std::path::Path;
+
+    use super::*;
+    use crate::test_util::{indices, random_fvec};
+
+    #[test]
+    fn test_streaming_matches_in_memory() {
+        let base = random_fvec(20, 3000, 1);
+        let query = random_fvec(20, 37, 2);
+        let base_name = format!("test_{}.fvecs", uuid::Uuid::new_v4());
+        let base_path = Path::new(&base_name);
+        base.save(base_path);
+        let expected = indices(&crate::ground_true(&base, &query, 10));
+        // chunks that are not a multiple of the blocks, and one chunk
+        for chunk_rows in [999, 1 << 20] {
+            let got = ground_true_streaming(base_path, &query, 10, chunk_rows, None);
+            assert_eq!(indices(&got), expected);
+        }
+        std::fs::remove_file(base_path).unwrap();
+    }
+
+    #[test]
+    fn test_streaming_resumes_from_checkpoint() {
+        let base = random_fvec(8, 2500, 3);
+        let query = random_fvec(8, 20, 4);
+        let uuid = uuid::Uuid::new_v4();
+        let base_name = format!("test_{}.fvecs", uuid);
+        let query_name = format!("test_{}_query.fvecs", uuid);
+        let checkpoint_name = format!("test_{}.partial", uuid);
+        let base_path = Path::new(&base_name);
+        let query_path = Path::new(&query_name);
+        let path = Path::new(&checkpoint_name);
+        base.save(base_path);
+        query.save(query_path);
+        // a run that stopped after the first 1000 rows
+        let fingerprint = format!(
+            "{} {} k=5",
+            file_fingerprint(base_path),
+            file_fingerprint(query_path)
+        );
+        let mut tops: Vec<TopK> = (0..query.num).map(|_| TopK::new(5)).collect();
+        score_chunk(&query, &base.slice(0, 1000), 0, &mut tops);
+        save_checkpoint(path, &fingerprint, 1000, base.num, &mut tops);
+        let checkpoint = Checkpoint { path, query_path };
+        let got = ground_true_streaming(base_path, &query, 5, 700, Some(checkpoint));
+        assert_eq!(
+            indices(&got),
+            indices(&crate::ground_true(&base, &query, 5))
+        );
+        // the same checkpoint for another query file is refused
+        let stale = std::panic::catch_unwind(|| {
+            let checkpoint = Checkpoint {
+                path,
+                query_path: base_path,
+            };
+            ground_true_streaming(base_path, &query, 5, 700, Some(checkpoint))
+        });
+        assert!(stale.is_err());
+        for file in [base_path, query_path, path] {
+            std::fs::remove_file(file).unwrap();
+        }
+    }
+}
@@ -0,0 +1,29 @@
+//! helpers shared by the unit tests
+
+use crate::{read_fvecs::Fvec, DistanceWithIndex};
+
+/// xorshift, enough to get varied values without a rand dependency. the
+/// next float in [0, 1) of the sequence of seed
+pub fn random(seed: &mut u64) -> f32 {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    (*seed >> 40) as f32 / (1u64 << 24) as f32
+}
+
+/// n floats in [0, 1)
+pub fn random_vec(n: usize, mut seed: u64) -> Vec<f32> {
+    (0..n).map(|_| random(&mut seed)).collect()
+}
+
+/// num vectors of dim floats in [0, 1)
+pub fn random_fvec(dim: usize, num: usize, seed: u64) -> Fvec {
+    Fvec::new(dim, num, random_vec(dim * num, seed))
+}
+
+/// the ids of ground truth results, without the distances
+pub fn indices(gt: &[Vec<DistanceWithIndex>]) -> Vec<Vec<usize>> {
+    gt.iter()
+        .map(|knn| knn.iter().map(|x| x.index).collect())
+        .collect()
+}